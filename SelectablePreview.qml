@@ -17,6 +17,7 @@
 
 import QtQuick 2.11
 import QtQuick.Controls 2.3
+import QtQuick.Window 2.11
 import QtQml 2.11
 
 
@@ -26,6 +27,24 @@ Button {
     property int antialiasing: 0
     property int hintstyle: 0
     property int subpixel: 0
-    icon.color: "transparent" // makes the actual image visible
-    icon.source: "image://renderpreview/" + fontFamily + "/" + fontSize + "/" + antialiasing + "/" + hintstyle + "/" + subpixel
+    // the previews of a grid share one sprite sheet, which holds this preview at cellIndex
+    property string sheetSource: ""
+    property int sheetColumns: 1
+    property int sheetRows: 1
+    property int cellIndex: 0
+    property real devicePixelRatio: Screen.devicePixelRatio
+    contentItem: Item {
+        implicitWidth: sheet.width / sheetColumns
+        implicitHeight: sheet.height / sheetRows
+        clip: true
+        Image {
+            id: sheet
+            source: sheetSource
+            // the sheet is rendered natively for the screen, in device pixels
+            width: sourceSize.width / devicePixelRatio
+            height: sourceSize.height / devicePixelRatio
+            x: -(cellIndex % sheetColumns) * parent.implicitWidth
+            y: -Math.floor(cellIndex / sheetColumns) * parent.implicitHeight
+        }
+    }
 }
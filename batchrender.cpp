@@ -0,0 +1,227 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Headless batch renderer for previews.
+ *
+ * Reads preview ids in the format of PreviewParameters::fromString, one per line, from a file or
+ * from stdin. Empty lines and lines starting with # are skipped. The previews are rendered in
+ * parallel and written as PNG files or as raw image stream to stdout. Finally the throughput and
+ * the latency percentiles of the renderings are reported on stderr.
+ *
+ * The raw stream consists of one record per preview in the order of completion: a header line
+ * "index width height devicePixelRatio\n" followed by the pixels in QImage::Format_ARGB32 without
+ * padding, i.e. 4 * width * height bytes.
+ */
+
+#include "menupreview.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QMutex>
+#include <QRunnable>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+
+#include <algorithm>
+
+namespace
+{
+
+/**
+ * State shared by all render tasks.
+ */
+struct Batch
+{
+    MenuPreviewRenderer renderer{ Qt::white };
+    QSize requestedSize;
+    QString outputDirectory;
+    bool raw;
+
+    QMutex outputMutex;
+    QFile* output;
+    QTextStream* errors;
+
+    /**
+     * @brief latencies of the renderings in nanoseconds, indexed like the ids, negative for
+     * failed renderings and images, which could not be written.
+     */
+    QVector<qint64> latencies;
+};
+
+class RenderTask : public QRunnable
+{
+private:
+    Batch* batch;
+    int index;
+    QString id;
+
+public:
+    RenderTask(Batch* batch, int index, const QString& id) : batch(batch), index(index), id(id)
+    {
+    }
+
+    void run() override
+    {
+        QElapsedTimer timer;
+        timer.start();
+        auto image = batch->renderer.getImage(PreviewParameters::fromString(id),
+                                              batch->requestedSize);
+        auto latency = timer.nsecsElapsed();
+        if (image.isNull()) {
+            batch->latencies[index] = -1;
+            return;
+        }
+        batch->latencies[index] = latency;
+
+        if (batch->raw) {
+            auto pixels = image.convertToFormat(QImage::Format_ARGB32);
+            QMutexLocker locker(&batch->outputMutex);
+            batch->output->write(QString("%1 %2 %3 %4\n")
+                                     .arg(index)
+                                     .arg(pixels.width())
+                                     .arg(pixels.height())
+                                     .arg(pixels.devicePixelRatio())
+                                     .toLatin1());
+            for (int y = 0; y < pixels.height(); ++y) {
+                batch->output->write(reinterpret_cast<const char*>(pixels.constScanLine(y)),
+                                     4 * pixels.width());
+            }
+        } else if (!batch->outputDirectory.isEmpty()) {
+            auto name = QString("%1.png").arg(index, 6, 10, QChar('0'));
+            auto path = QDir(batch->outputDirectory).filePath(name);
+            if (!image.save(path, "PNG")) {
+                batch->latencies[index] = -1;
+                QMutexLocker locker(&batch->outputMutex);
+                *batch->errors << "cannot write " << path << "\n";
+                batch->errors->flush();
+            }
+        }
+    }
+};
+
+QStringList readIds(QFile* input)
+{
+    QStringList ids;
+    QTextStream stream(input);
+    while (!stream.atEnd()) {
+        auto line = stream.readLine().trimmed();
+        if (!line.isEmpty() && !line.startsWith('#')) {
+            ids.append(line);
+        }
+    }
+    return ids;
+}
+
+double percentile(const QVector<qint64>& sorted, double fraction)
+{
+    if (sorted.isEmpty()) {
+        return 0;
+    }
+    auto rank = static_cast<int>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted.at(rank) / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // icons are rasterized without a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Render previews without user interface.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("ids", "File with one preview id per line, stdin if omitted.");
+    QCommandLineOption outputOption({ "o", "output" }, "Directory for PNG files.", "directory");
+    QCommandLineOption rawOption("raw", "Write a raw image stream to stdout instead of PNG files.");
+    QCommandLineOption threadsOption("threads", "Number of render threads.", "count",
+                                     QString::number(QThread::idealThreadCount()));
+    QCommandLineOption sizeOption("size", "Requested size of the previews in pixels.", "WxH");
+    parser.addOptions({ outputOption, rawOption, threadsOption, sizeOption });
+    parser.process(app);
+
+    QTextStream err(stderr);
+    if (parser.isSet(rawOption) && parser.isSet(outputOption)) {
+        err << "--raw and --output exclude each other\n";
+        return 1;
+    }
+    QFile input;
+    if (parser.positionalArguments().isEmpty() || parser.positionalArguments().first() == "-") {
+        input.open(stdin, QIODevice::ReadOnly);
+    } else {
+        input.setFileName(parser.positionalArguments().first());
+        if (!input.open(QIODevice::ReadOnly)) {
+            err << "cannot read " << input.fileName() << "\n";
+            return 1;
+        }
+    }
+    auto ids = readIds(&input);
+
+    Batch batch;
+    batch.raw = parser.isSet(rawOption);
+    batch.outputDirectory = parser.value(outputOption);
+    if (!batch.outputDirectory.isEmpty() && !QDir().mkpath(batch.outputDirectory)) {
+        err << "cannot create " << batch.outputDirectory << "\n";
+        return 1;
+    }
+    auto size = parser.value(sizeOption).split('x');
+    if (size.length() == 2) {
+        batch.requestedSize = QSize(size[0].toInt(), size[1].toInt());
+    }
+    QFile output;
+    output.open(stdout, QIODevice::WriteOnly);
+    batch.output = &output;
+    batch.errors = &err;
+    batch.latencies.resize(ids.size());
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(qMax(1, parser.value(threadsOption).toInt()));
+    // workers keep their FreeType library with the open faces, see FreeTypeLibrary
+    pool.setExpiryTimeout(-1);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < ids.size(); ++i) {
+        pool.start(new RenderTask(&batch, i, ids.at(i)));
+    }
+    pool.waitForDone();
+    auto elapsed = timer.nsecsElapsed();
+    output.flush();
+
+    QVector<qint64> latencies;
+    for (auto latency : batch.latencies) {
+        if (latency >= 0) {
+            latencies.append(latency);
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    err << "images: " << latencies.size() << " rendered, " << ids.size() - latencies.size()
+        << " failed\n";
+    err << "throughput: " << latencies.size() * 1e9 / qMax(1ll, elapsed) << " images/s\n";
+    err << "latency: p50 " << percentile(latencies, 0.5) << " ms, p99 "
+        << percentile(latencies, 0.99) << " ms\n";
+    return latencies.size() == ids.size() ? 0 : 1;
+}
@@ -0,0 +1,677 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Benchmark suite for the stages of the rendering pipeline.
+ *
+ * Every stage is timed on its own:
+ *  - resolve: FontManagement::retrievePath, the first lookup and memoized lookups
+ *  - face: opening a face with a fresh FreeTypeLibrary and reusing an open face
+ *  - shape: a Harfbuzz shaping run, bypassing the shaping cache
+ *  - raster: loading and rendering the shaped glyphs for every FT_Render_Mode, bypassing the
+ *    glyph cache
+ *  - layout: FontShaping as used by the renderer, i.e. with all caches warm
+ *  - paint: painting synthetic glyphs per pixel through QColor as before the kernels (baseline),
+ *    with every RasteredGlyph subclass (glyph) and with the scanline kernels of every supported
+ *    instruction set
+ *  - preview: MenuPreviewRenderer::getImage end to end, the first and repeated renderings
+ *
+ * Fonts, sizes and text lengths are given on the command line. Results are written as text, JSON
+ * or CSV, so they can be collected for tracking trends. No display is needed.
+ */
+
+#include "blendkernels.h"
+#include "freetype-renderer.h"
+#include "menupreview.h"
+
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QVector>
+
+#include <cstdlib>
+
+namespace
+{
+static const int GLYPH_WIDTH = 64;
+static const int GLYPH_HEIGHT = 64;
+static const char* SAMPLE_TEXT = "The quick brown fox jumps over the lazy dog. ";
+
+/**
+ * Result of timing one stage with one set of parameters.
+ */
+struct Measurement
+{
+    QString stage;
+    QString variant;
+    QString font;
+    double size;
+    int length;
+    qint64 runs;
+    double nanosecondsPerRun;
+
+    /**
+     * @brief itemsPerRun are the units processed by one run, e.g. glyphs or pixels.
+     */
+    qint64 itemsPerRun;
+    QString unit;
+
+    double itemsPerSecond() const
+    {
+        return nanosecondsPerRun > 0 ? itemsPerRun * 1e9 / nanosecondsPerRun : 0;
+    }
+};
+
+class Report
+{
+private:
+    QList<Measurement> measurements;
+    qint64 duration;
+
+public:
+    /**
+     * @param duration in nanoseconds, for which every measurement repeats the stage
+     */
+    explicit Report(qint64 duration) : duration(duration)
+    {
+    }
+
+    /**
+     * Run the function repeatedly for a while and record the time per run.
+     */
+    template <typename Function>
+    void measure(Measurement measurement, Function run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 runs = 0;
+        do {
+            run();
+            ++runs;
+        } while (timer.nsecsElapsed() < duration);
+        measurement.runs = runs;
+        measurement.nanosecondsPerRun = static_cast<double>(timer.nsecsElapsed()) / runs;
+        measurements.append(measurement);
+    }
+
+    /**
+     * Run the function repeatedly for a while and record the time per run, where the reset
+     * between the runs is not timed.
+     */
+    template <typename Function, typename Reset>
+    void measure(Measurement measurement, Function run, Reset reset)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 runs = 0;
+        qint64 timed = 0;
+        do {
+            QElapsedTimer runTimer;
+            runTimer.start();
+            run();
+            timed += runTimer.nsecsElapsed();
+            ++runs;
+            reset();
+        } while (timer.nsecsElapsed() < duration);
+        measurement.runs = runs;
+        measurement.nanosecondsPerRun = static_cast<double>(timed) / runs;
+        measurements.append(measurement);
+    }
+
+    /**
+     * Run the function once, for stages, which behave differently when repeated.
+     */
+    template <typename Function>
+    void measureOnce(Measurement measurement, Function run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        run();
+        measurement.runs = 1;
+        measurement.nanosecondsPerRun = timer.nsecsElapsed();
+        measurements.append(measurement);
+    }
+
+    void writeText(QTextStream& out) const
+    {
+        out << "stage\tvariant\tfont\tsize\tlength\truns\tus/run\tthroughput\n";
+        for (const auto& m : measurements) {
+            out << m.stage << '\t' << m.variant << '\t' << m.font << '\t' << m.size << '\t'
+                << m.length << '\t' << m.runs << '\t' << m.nanosecondsPerRun / 1e3 << '\t'
+                << m.itemsPerSecond() / 1e6 << " M" << m.unit << "/s\n";
+        }
+    }
+
+    void writeCsv(QTextStream& out) const
+    {
+        out << "stage,variant,font,size,length,runs,ns_per_run,items_per_run,unit,items_per_s\n";
+        for (const auto& m : measurements) {
+            out << m.stage << ',' << m.variant << ",\"" << m.font << "\"," << m.size << ','
+                << m.length << ',' << m.runs << ',' << m.nanosecondsPerRun << ','
+                << m.itemsPerRun << ',' << m.unit << ',' << m.itemsPerSecond() << '\n';
+        }
+    }
+
+    void writeJson(QTextStream& out) const
+    {
+        QJsonArray results;
+        for (const auto& m : measurements) {
+            QJsonObject result;
+            result["stage"] = m.stage;
+            result["variant"] = m.variant;
+            result["font"] = m.font;
+            result["size"] = m.size;
+            result["length"] = m.length;
+            result["runs"] = static_cast<double>(m.runs);
+            result["ns_per_run"] = m.nanosecondsPerRun;
+            result["items_per_run"] = static_cast<double>(m.itemsPerRun);
+            result["unit"] = m.unit;
+            result["items_per_s"] = m.itemsPerSecond();
+            results.append(result);
+        }
+        out << QJsonDocument(results).toJson();
+    }
+};
+
+Measurement measurement(const QString& stage,
+                        const QString& variant,
+                        const QString& font = QString(),
+                        double size = 0,
+                        int length = 0,
+                        qint64 itemsPerRun = 1,
+                        const QString& unit = "op")
+{
+    return Measurement{ stage, variant, font, size, length, 0, 0, itemsPerRun, unit };
+}
+
+QByteArray sampleText(int length)
+{
+    QByteArray text;
+    while (text.size() < length) {
+        text.append(SAMPLE_TEXT);
+    }
+    return text.left(length);
+}
+
+/**
+ * The rendering variants of the preview grid, one for every FT_Render_Mode.
+ */
+QList<QPair<QString, KXftConfig>> renderVariants()
+{
+    using AA = KXftConfig::AntiAliasing;
+    using Hint = KXftConfig::Hint;
+    using SubPixel = KXftConfig::SubPixel;
+    const auto hinting = KXftConfig::Hinting::Enabled;
+    return { qMakePair(QString("mono"), KXftConfig(AA::Disabled, hinting, Hint::Full,
+                                                   SubPixel::None, 96u, 96u)),
+             qMakePair(QString("gray"), KXftConfig(AA::Enabled, hinting, Hint::Slight,
+                                                   SubPixel::None, 96u, 96u)),
+             qMakePair(QString("lcd"), KXftConfig(AA::Enabled, hinting, Hint::Slight,
+                                                  SubPixel::Rgb, 96u, 96u)),
+             qMakePair(QString("lcd-v"), KXftConfig(AA::Enabled, hinting, Hint::Slight,
+                                                    SubPixel::Vrgb, 96u, 96u)) };
+}
+
+void benchmarkResolve(Report* report, const QStringList& fonts)
+{
+    for (const auto& font : fonts) {
+        auto name = font.toLocal8Bit();
+        FontManagement fontManagement;
+        report->measureOnce(measurement("resolve", "first", font),
+                            [&]() { fontManagement.retrievePath(name); });
+        report->measure(measurement("resolve", "memoized", font),
+                        [&]() { fontManagement.retrievePath(name); });
+    }
+}
+
+/**
+ * Benchmark opening and reusing a face, which depends on font and size only. Opening covers
+ * FT_New_Face and scaling, but neither the initialization of FreeType nor closing the face.
+ */
+void benchmarkFace(Report* report, const QString& font, double size)
+{
+    auto fontFile = FontManagement::instance().retrievePath(font.toLocal8Bit());
+    CharSize charSize(FreeTypeLibrary::convertPointSize(size), 96, 96);
+
+    FreeTypeLibrary library;
+    report->measure(measurement("face", "open", font, size),
+                    [&]() { library.getFontFace(*fontFile, charSize); },
+                    [&]() { library.closeFaces(); });
+
+    if (library.getFontFace(*fontFile, charSize) == nullptr) {
+        return;
+    }
+    report->measure(measurement("face", "reuse", font, size),
+                    [&]() { library.getFontFace(*fontFile, charSize); });
+}
+
+/**
+ * Benchmark the stages, which depend on font, size and text.
+ */
+void benchmarkText(Report* report, const QString& font, double size, int length)
+{
+    auto fontFile = FontManagement::instance().retrievePath(font.toLocal8Bit());
+    CharSize charSize(FreeTypeLibrary::convertPointSize(size), 96, 96);
+    auto text = sampleText(length);
+
+    FreeTypeLibrary library;
+    auto face = library.getFontFace(*fontFile, charSize);
+    if (face == nullptr) {
+        return;
+    }
+
+    auto hbFont = library.getHarfbuzzFont(face);
+    hb_font_set_ppem(hbFont, face->size->metrics.x_ppem, face->size->metrics.y_ppem);
+    QVector<quint32> glyphIndices;
+    auto shape = [&]() {
+        auto buffer = library.acquireBuffer();
+        hb_buffer_add_utf8(buffer, text.constData(), text.size(), 0, text.size());
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(hbFont, buffer, nullptr, 0);
+        unsigned int count = 0;
+        auto infos = hb_buffer_get_glyph_infos(buffer, &count);
+        glyphIndices.resize(static_cast<int>(count));
+        for (unsigned int i = 0; i < count; ++i) {
+            glyphIndices[static_cast<int>(i)] = infos[i].codepoint;
+        }
+        library.releaseBuffer(buffer);
+    };
+    report->measure(measurement("shape", "harfbuzz", font, size, length, length, "char"), shape);
+
+    for (const auto& variant : renderVariants()) {
+        FreeTypeParameters parameters(variant.second);
+        report->measure(measurement("raster", variant.first, font, size, length,
+                                    glyphIndices.size(), "glyph"),
+                        [&]() {
+                            for (auto glyphIndex : glyphIndices) {
+                                FT_Load_Glyph(face, glyphIndex, parameters.loadFlags);
+                                FT_Render_Glyph(face->glyph, parameters.renderMode);
+                            }
+                        });
+    }
+
+    for (const auto& variant : renderVariants()) {
+        auto fontName = font.toLocal8Bit();
+        report->measure(measurement("layout", variant.first, font, size, length,
+                                    glyphIndices.size(), "glyph"),
+                        [&]() {
+                            FontShaping shaping(&FreeTypeLibrary::forCurrentThread(),
+                                                &FontManagement::instance(), text, fontName, size,
+                                                variant.second);
+                        });
+    }
+}
+
+/**
+ * Coverage data in the layout of a FreeType bitmap, filled with random values.
+ */
+class SyntheticGlyph
+{
+public:
+    QVector<unsigned char> data;
+    FT_Bitmap bitmap;
+
+    SyntheticGlyph(FT_Pixel_Mode pixelMode, unsigned int width, unsigned int rows)
+        : data(static_cast<int>(bytesPerRow(pixelMode, width) * rows)), bitmap(FT_Bitmap())
+    {
+        for (auto& value : data) {
+            value = static_cast<unsigned char>(rand() & 0xff);
+        }
+        bitmap.rows = rows;
+        bitmap.width = width;
+        bitmap.pitch = static_cast<int>(bytesPerRow(pixelMode, width));
+        bitmap.buffer = data.data();
+        bitmap.pixel_mode = pixelMode;
+    }
+
+    static unsigned int bytesPerRow(FT_Pixel_Mode pixelMode, unsigned int width)
+    {
+        return pixelMode == FT_PIXEL_MODE_MONO ? (width + 7) / 8 : width;
+    }
+};
+
+/**
+ * Copies of the per pixel painting of the glyph classes before the blend kernels, which read and
+ * write every pixel through QColor. They are kept as the baseline of the paint series, the way the
+ * kernel test keeps the reference formula.
+ */
+void baselineMonochrome(QImage* canvas, const FT_Bitmap& bitmap, const QColor& pen)
+{
+    for (uint glyphY = 0; glyphY < bitmap.rows; glyphY++) {
+        for (uint glyphX = 0; glyphX < bitmap.width; glyphX++) {
+            uint index = glyphY * static_cast<uint>(abs(bitmap.pitch)) + glyphX / 8;
+            if (bitmap.buffer[index] >> (7 - glyphX % 8) & 0x1) {
+                canvas->setPixel(static_cast<int>(glyphX), static_cast<int>(glyphY), pen.rgb());
+            }
+        }
+    }
+}
+
+void baselineGray(QImage* canvas, const FT_Bitmap& bitmap, const QColor& pen)
+{
+    int pen_r, pen_g, pen_b;
+    pen.getRgb(&pen_r, &pen_g, &pen_b);
+    for (int j = 0; static_cast<uint>(j) < bitmap.rows; ++j) {
+        for (int i = 0; static_cast<uint>(i) < bitmap.width; ++i) {
+            auto value = bitmap.buffer[j * bitmap.pitch + i];
+            int backgound_r, backgound_g, backgound_b;
+            canvas->pixelColor(i, j).getRgb(&backgound_r, &backgound_g, &backgound_b);
+            int result_r = ((255 - value) * backgound_r + value * pen_r) / 255;
+            int result_g = ((255 - value) * backgound_g + value * pen_g) / 255;
+            int result_b = ((255 - value) * backgound_b + value * pen_b) / 255;
+            canvas->setPixel(i, j, qRgb(result_r, result_g, result_b));
+        }
+    }
+}
+
+/**
+ * The sub-pixel painting before the kernels, which gets every channel by a virtual call.
+ */
+class BaselineSubPixelGlyph
+{
+protected:
+    const FT_Bitmap& bitmap;
+    const int width;
+    const int height;
+    const bool reverse;
+
+public:
+    BaselineSubPixelGlyph(const FT_Bitmap& bitmap, int width, int height, bool reverse)
+        : bitmap(bitmap), width(width), height(height), reverse(reverse)
+    {
+    }
+
+    virtual ~BaselineSubPixelGlyph() = default;
+
+    virtual unsigned char getValue(int row, int column, int subPixelOffset) = 0;
+
+    void paint(QImage* canvas, const QColor& pen)
+    {
+        int pen_r, pen_g, pen_b;
+        pen.getRgb(&pen_r, &pen_g, &pen_b);
+        int offset_r = reverse ? 2 : 0;
+        int offset_g = 1;
+        int offset_b = reverse ? 0 : 2;
+        for (int j = 0; j < height; ++j) {
+            for (int i = 0; i < width; ++i) {
+                int backgound_r, backgound_g, backgound_b;
+                canvas->pixelColor(i, j).getRgb(&backgound_r, &backgound_g, &backgound_b);
+                unsigned char value_r = getValue(j, i, offset_r);
+                unsigned char value_g = getValue(j, i, offset_g);
+                unsigned char value_b = getValue(j, i, offset_b);
+                int result_r = ((255 - value_r) * backgound_r + value_r * pen_r) / 255;
+                int result_g = ((255 - value_g) * backgound_g + value_g * pen_g) / 255;
+                int result_b = ((255 - value_b) * backgound_b + value_b * pen_b) / 255;
+                canvas->setPixel(i, j, qRgb(result_r, result_g, result_b));
+            }
+        }
+    }
+};
+
+class BaselineHorizontalGlyph : public BaselineSubPixelGlyph
+{
+public:
+    BaselineHorizontalGlyph(const FT_Bitmap& bitmap, bool reverse)
+        : BaselineSubPixelGlyph(bitmap, static_cast<int>(bitmap.width / 3),
+                                static_cast<int>(bitmap.rows), reverse)
+    {
+    }
+
+    unsigned char getValue(int row, int column, int subPixelOffset) override
+    {
+        return bitmap.buffer[row * bitmap.pitch + 3 * column + subPixelOffset];
+    }
+};
+
+class BaselineVerticalGlyph : public BaselineSubPixelGlyph
+{
+public:
+    BaselineVerticalGlyph(const FT_Bitmap& bitmap, bool reverse)
+        : BaselineSubPixelGlyph(bitmap, static_cast<int>(bitmap.width),
+                                static_cast<int>(bitmap.rows / 3), reverse)
+    {
+    }
+
+    unsigned char getValue(int row, int column, int subPixelOffset) override
+    {
+        return bitmap.buffer[(3 * row + subPixelOffset) * bitmap.pitch + column];
+    }
+};
+
+const char* instructionSetName(BlendInstructionSet instructionSet)
+{
+    switch (instructionSet) {
+    case BlendInstructionSet::Scalar:
+        return "scalar";
+    case BlendInstructionSet::SSE2:
+        return "sse2";
+    case BlendInstructionSet::SSSE3:
+        return "ssse3";
+    case BlendInstructionSet::AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+/**
+ * Paint the glyph the way it was painted before the kernels, through its RasteredGlyph subclass,
+ * which selects a specialized GlyphPainter, and with the kernels of all instruction sets.
+ */
+template <typename Glyph, typename Baseline, typename KernelRun>
+void benchmarkOrder(
+    Report* report, const QString& order, Glyph& glyph, Baseline baseline, KernelRun kernelRun)
+{
+    const QColor pen(0x20, 0x40, 0x80);
+    const qint64 pixels = GLYPH_WIDTH * GLYPH_HEIGHT;
+
+    // the canvas format of the renderer before the kernels
+    QImage original(GLYPH_WIDTH, GLYPH_HEIGHT, QImage::Format_RGB888);
+    original.fill(Qt::white);
+    report->measure(measurement("paint", order + "/baseline", QString(), 0, 0, pixels, "px"),
+                    [&]() { baseline(&original, pen); });
+
+    QImage reference(GLYPH_WIDTH, GLYPH_HEIGHT, QImage::Format_RGB888);
+    reference.fill(Qt::white);
+    report->measure(measurement("paint", order + "/glyph", QString(), 0, 0, pixels, "px"),
+                    [&]() { glyph.paint(&reference, 0, 0, pen); });
+
+    QImage canvas(GLYPH_WIDTH, GLYPH_HEIGHT, QImage::Format_RGB32);
+    canvas.fill(Qt::white);
+    for (auto instructionSet : { BlendInstructionSet::Scalar, BlendInstructionSet::SSE2,
+                                 BlendInstructionSet::SSSE3, BlendInstructionSet::AVX2 }) {
+        if (!isBlendInstructionSetSupported(instructionSet)) {
+            continue;
+        }
+        const auto& kernels = blendKernels(instructionSet);
+        auto variant = order + "/" + instructionSetName(instructionSet);
+        report->measure(measurement("paint", variant, QString(), 0, 0, pixels, "px"),
+                        [&]() { kernelRun(kernels, &canvas); });
+    }
+}
+
+void benchmarkPaint(Report* report)
+{
+    const quint32 pen = QColor(0x20, 0x40, 0x80).rgb();
+
+    SyntheticGlyph mono(FT_PIXEL_MODE_MONO, GLYPH_WIDTH, GLYPH_HEIGHT);
+    MonochromeGlyph monoGlyph(&mono.bitmap);
+    auto monoBaseline = [&](QImage* canvas, const QColor& color) {
+        baselineMonochrome(canvas, mono.bitmap, color);
+    };
+    auto monoKernelRun = [&](const BlendKernels& kernels, QImage* canvas) {
+        for (int y = 0; y < GLYPH_HEIGHT; ++y) {
+            auto target = reinterpret_cast<quint32*>(canvas->scanLine(y));
+            kernels.monochromeScanline(target, mono.data.constData() + y * mono.bitmap.pitch, 0,
+                                       GLYPH_WIDTH, pen);
+        }
+    };
+    benchmarkOrder(report, "mono", monoGlyph, monoBaseline, monoKernelRun);
+
+    SyntheticGlyph gray(FT_PIXEL_MODE_GRAY, GLYPH_WIDTH, GLYPH_HEIGHT);
+    GrayScaleGlyph grayGlyph(&gray.bitmap);
+    auto grayBaseline = [&](QImage* canvas, const QColor& color) {
+        baselineGray(canvas, gray.bitmap, color);
+    };
+    auto grayKernelRun = [&](const BlendKernels& kernels, QImage* canvas) {
+        for (int y = 0; y < GLYPH_HEIGHT; ++y) {
+            auto target = reinterpret_cast<quint32*>(canvas->scanLine(y));
+            kernels.grayScanline(target, gray.data.constData() + y * GLYPH_WIDTH, GLYPH_WIDTH, pen);
+        }
+    };
+    benchmarkOrder(report, "gray", grayGlyph, grayBaseline, grayKernelRun);
+
+    SyntheticGlyph horizontal(FT_PIXEL_MODE_LCD, 3 * GLYPH_WIDTH, GLYPH_HEIGHT);
+    for (bool reversed : { false, true }) {
+        SubPixelGlyph glyph(&horizontal.bitmap, reversed);
+        BaselineHorizontalGlyph baselineGlyph(horizontal.bitmap, reversed);
+        auto baseline = [&](QImage* canvas, const QColor& color) {
+            baselineGlyph.paint(canvas, color);
+        };
+        auto kernelRun = [&](const BlendKernels& kernels, QImage* canvas) {
+            auto kernel = reversed ? kernels.bgrScanline : kernels.rgbScanline;
+            for (int y = 0; y < GLYPH_HEIGHT; ++y) {
+                auto target = reinterpret_cast<quint32*>(canvas->scanLine(y));
+                kernel(target, horizontal.data.constData() + 3 * y * GLYPH_WIDTH, GLYPH_WIDTH, pen);
+            }
+        };
+        benchmarkOrder(report, reversed ? "bgr" : "rgb", glyph, baseline, kernelRun);
+    }
+
+    SyntheticGlyph vertical(FT_PIXEL_MODE_LCD_V, GLYPH_WIDTH, 3 * GLYPH_HEIGHT);
+    for (bool reversed : { false, true }) {
+        VerticalSubPixelGlyph glyph(&vertical.bitmap, reversed);
+        BaselineVerticalGlyph baselineGlyph(vertical.bitmap, reversed);
+        auto baseline = [&](QImage* canvas, const QColor& color) {
+            baselineGlyph.paint(canvas, color);
+        };
+        auto kernelRun = [&](const BlendKernels& kernels, QImage* canvas) {
+            for (int y = 0; y < GLYPH_HEIGHT; ++y) {
+                auto target = reinterpret_cast<quint32*>(canvas->scanLine(y));
+                const unsigned char* top = vertical.data.constData() + 3 * y * GLYPH_WIDTH;
+                const unsigned char* middle = top + GLYPH_WIDTH;
+                const unsigned char* bottom = middle + GLYPH_WIDTH;
+                if (reversed) {
+                    kernels.verticalScanline(target, bottom, middle, top, GLYPH_WIDTH, pen);
+                } else {
+                    kernels.verticalScanline(target, top, middle, bottom, GLYPH_WIDTH, pen);
+                }
+            }
+        };
+        benchmarkOrder(report, reversed ? "vbgr" : "vrgb", glyph, baseline, kernelRun);
+    }
+}
+
+void benchmarkPreview(Report* report, const QString& font, double size)
+{
+    MenuPreviewRenderer renderer(Qt::white);
+    for (const auto& variant : renderVariants()) {
+        PreviewParameters parameters(font, size, variant.second);
+        // the first rendering fills the caches, which serve the repeated renderings
+        report->measureOnce(measurement("preview", variant.first + "/first", font, size),
+                            [&]() { renderer.getImage(parameters); });
+        report->measure(measurement("preview", variant.first + "/cached", font, size),
+                        [&]() { renderer.getImage(parameters); });
+    }
+}
+
+template <typename T, typename Convert>
+QList<T> parseList(const QString& values, Convert convert)
+{
+    QList<T> result;
+    for (const auto& value : values.split(',', QString::SkipEmptyParts)) {
+        result.append(convert(value.trimmed()));
+    }
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // icons and fonts do not need a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark the stages of the preview rendering pipeline.");
+    parser.addHelpOption();
+    QCommandLineOption fontsOption("fonts", "Comma separated font names.", "fonts",
+                                   "DejaVu Sans");
+    QCommandLineOption sizesOption("sizes", "Comma separated sizes in points.", "sizes", "10");
+    QCommandLineOption lengthsOption("lengths", "Comma separated text lengths in characters.",
+                                     "lengths", "16,256");
+    QCommandLineOption durationOption("duration", "Milliseconds every measurement runs.", "ms",
+                                      "200");
+    QCommandLineOption formatOption("format", "Output format: text, json or csv.", "format",
+                                    "text");
+    QCommandLineOption stagesOption(
+        "stages", "Comma separated stages: resolve, text (face, shape, raster, layout), paint, "
+                  "preview.",
+        "stages", "resolve,text,paint,preview");
+    parser.addOptions({ fontsOption, sizesOption, lengthsOption, durationOption, formatOption,
+                        stagesOption });
+    parser.process(app);
+
+    auto fonts = parser.value(fontsOption).split(',', QString::SkipEmptyParts);
+    auto sizes =
+        parseList<double>(parser.value(sizesOption), [](const QString& v) { return v.toDouble(); });
+    auto lengths =
+        parseList<int>(parser.value(lengthsOption), [](const QString& v) { return v.toInt(); });
+    auto stages = parser.value(stagesOption).split(',', QString::SkipEmptyParts);
+    Report report(qMax(1ll, parser.value(durationOption).toLongLong()) * 1000000);
+
+    if (stages.contains("resolve")) {
+        benchmarkResolve(&report, fonts);
+    }
+    if (stages.contains("text")) {
+        for (const auto& font : fonts) {
+            for (auto size : sizes) {
+                benchmarkFace(&report, font, size);
+                for (auto length : lengths) {
+                    benchmarkText(&report, font, size, length);
+                }
+            }
+        }
+    }
+    if (stages.contains("paint")) {
+        benchmarkPaint(&report);
+    }
+    if (stages.contains("preview")) {
+        for (const auto& font : fonts) {
+            for (auto size : sizes) {
+                benchmarkPreview(&report, font, size);
+            }
+        }
+    }
+
+    QTextStream out(stdout);
+    auto format = parser.value(formatOption);
+    if (format == "json") {
+        report.writeJson(out);
+    } else if (format == "csv") {
+        report.writeCsv(out);
+    } else {
+        report.writeText(out);
+    }
+    return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Scanline kernels for painting glyph coverage onto 32 bit pixels.
+ *
+ * The x86 kernels are compiled with function specific target attributes and selected at runtime,
+ * so the binary still runs on CPUs without the respective extensions.
+ */
+
+#include "blendkernels.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_KERNELS_X86
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace
+{
+
+/**********/
+/* Scalar */
+/**********/
+
+/**
+ * Exact division by 255 for values up to 255 * 255, without an actual division.
+ */
+inline quint32 divideBy255(quint32 value)
+{
+    return (value + 1 + (value >> 8)) >> 8;
+}
+
+inline quint32 blendChannel(quint32 background, quint32 pen, quint32 coverage)
+{
+    return divideBy255((255 - coverage) * background + coverage * pen);
+}
+
+inline quint32 blendPixel(quint32 background, quint32 pen, quint32 coverage)
+{
+    quint32 result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        auto channel = blendChannel(background >> shift & 0xff, pen >> shift & 0xff, coverage);
+        result |= channel << shift;
+    }
+    return result;
+}
+
+/**
+ * Blend the color channels separately, keep the alpha channel.
+ */
+inline quint32
+blendPixel(quint32 background, quint32 pen, quint32 red, quint32 green, quint32 blue)
+{
+    return (background & 0xff000000)
+           | blendChannel(background >> 16 & 0xff, pen >> 16 & 0xff, red) << 16
+           | blendChannel(background >> 8 & 0xff, pen >> 8 & 0xff, green) << 8
+           | blendChannel(background & 0xff, pen & 0xff, blue);
+}
+
+void grayScanlineScalar(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    for (int i = 0; i < count; ++i) {
+        quint32 value = coverage[i];
+        if (value == 0) {
+            continue;
+        }
+        target[i] = value == 255 ? pen : blendPixel(target[i], pen, value);
+    }
+}
+
+/**
+ * Pixel masks for every possible byte of a monochrome bitmap, the most significant bit denotes the
+ * leftmost pixel.
+ */
+struct MonochromeMasks
+{
+    alignas(32) quint32 masks[256][8];
+
+    MonochromeMasks()
+    {
+        for (int byte = 0; byte < 256; ++byte) {
+            for (int bit = 0; bit < 8; ++bit) {
+                masks[byte][bit] = (byte >> (7 - bit) & 0x1) ? 0xffffffff : 0;
+            }
+        }
+    }
+};
+
+const MonochromeMasks& monochromeMasks()
+{
+    static const MonochromeMasks table;
+    return table;
+}
+
+/**
+ * Paint the bits up to the next byte boundary.
+ * @return number of painted pixels
+ */
+inline int monochromeLeadingBits(
+    quint32* target, const unsigned char* bits, int firstBit, int count, quint32 pen)
+{
+    int bit = firstBit % 8;
+    if (bit == 0) {
+        return 0;
+    }
+    int length = qMin(8 - bit, count);
+    for (int k = 0; k < length; ++k) {
+        if (*bits >> (7 - bit - k) & 0x1) {
+            target[k] = pen;
+        }
+    }
+    return length;
+}
+
+/**
+ * Paint the first bits of a byte.
+ */
+inline void monochromeTrailingBits(quint32* target, unsigned char bits, int count, quint32 pen)
+{
+    for (int k = 0; k < count; ++k) {
+        if (bits >> (7 - k) & 0x1) {
+            target[k] = pen;
+        }
+    }
+}
+
+void monochromeScanlineScalar(
+    quint32* target, const unsigned char* bits, int firstBit, int count, quint32 pen)
+{
+    const auto& masks = monochromeMasks().masks;
+    bits += firstBit / 8;
+    int i = monochromeLeadingBits(target, bits, firstBit, count, pen);
+    if (i > 0) {
+        ++bits;
+    }
+    for (; i + 8 <= count; i += 8, ++bits) {
+        if (*bits == 0) {
+            continue;
+        }
+        const quint32* mask = masks[*bits];
+        for (int k = 0; k < 8; ++k) {
+            target[i + k] = (pen & mask[k]) | (target[i + k] & ~mask[k]);
+        }
+    }
+    if (i < count) {
+        monochromeTrailingBits(target + i, *bits, count - i, pen);
+    }
+}
+
+void rgbScanlineScalar(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    for (int i = 0; i < count; ++i, coverage += 3) {
+        if (coverage[0] | coverage[1] | coverage[2]) {
+            target[i] = blendPixel(target[i], pen, coverage[0], coverage[1], coverage[2]);
+        }
+    }
+}
+
+void bgrScanlineScalar(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    for (int i = 0; i < count; ++i, coverage += 3) {
+        if (coverage[0] | coverage[1] | coverage[2]) {
+            target[i] = blendPixel(target[i], pen, coverage[2], coverage[1], coverage[0]);
+        }
+    }
+}
+
+void verticalScanlineScalar(quint32* target,
+                            const unsigned char* red,
+                            const unsigned char* green,
+                            const unsigned char* blue,
+                            int count,
+                            quint32 pen)
+{
+    for (int i = 0; i < count; ++i) {
+        if (red[i] | green[i] | blue[i]) {
+            target[i] = blendPixel(target[i], pen, red[i], green[i], blue[i]);
+        }
+    }
+}
+
+#ifdef BLEND_KERNELS_X86
+
+/********/
+/* SSE2 */
+/********/
+
+/**
+ * Blend eight 16 bit channels, see divideBy255 for the division.
+ */
+TARGET_SSE2 inline __m128i blendChannels(__m128i background, __m128i pen, __m128i coverage)
+{
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i value = _mm_add_epi16(_mm_mullo_epi16(background, _mm_sub_epi16(full, coverage)),
+                                  _mm_mullo_epi16(pen, coverage));
+    value = _mm_add_epi16(value, _mm_add_epi16(one, _mm_srli_epi16(value, 8)));
+    return _mm_srli_epi16(value, 8);
+}
+
+/**
+ * Blend four pixels given the coverage replicated to all four bytes of a pixel.
+ */
+TARGET_SSE2 inline __m128i blendPixels(__m128i pixels, __m128i pen, __m128i coverage)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i low = blendChannels(_mm_unpacklo_epi8(pixels, zero), pen,
+                                _mm_unpacklo_epi8(coverage, zero));
+    __m128i high = blendChannels(_mm_unpackhi_epi8(pixels, zero), pen,
+                                 _mm_unpackhi_epi8(coverage, zero));
+    return _mm_packus_epi16(low, high);
+}
+
+TARGET_SSE2 void
+grayScanlineSse2(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    const __m128i penWide
+        = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(pen)), _mm_setzero_si128());
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        qint32 packed;
+        memcpy(&packed, coverage + i, sizeof(packed));
+        if (packed == 0) {
+            continue;
+        }
+        // replicate every coverage byte to the four bytes of its pixel
+        __m128i values = _mm_cvtsi32_si128(packed);
+        values = _mm_unpacklo_epi8(values, values);
+        values = _mm_unpacklo_epi16(values, values);
+
+        auto address = reinterpret_cast<__m128i*>(target + i);
+        _mm_storeu_si128(address, blendPixels(_mm_loadu_si128(address), penWide, values));
+    }
+    grayScanlineScalar(target + i, coverage + i, count - i, pen);
+}
+
+TARGET_SSE2 void verticalScanlineSse2(quint32* target,
+                                      const unsigned char* red,
+                                      const unsigned char* green,
+                                      const unsigned char* blue,
+                                      int count,
+                                      quint32 pen)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i penWide = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(pen)), zero);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i r = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(red + i));
+        __m128i g = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(green + i));
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(blue + i));
+
+        // interleave the rows to the byte order of a pixel: blue, green, red, alpha (zero)
+        __m128i blueGreen = _mm_unpacklo_epi8(b, g);
+        __m128i redAlpha = _mm_unpacklo_epi8(r, zero);
+        __m128i low = _mm_unpacklo_epi16(blueGreen, redAlpha);
+        __m128i high = _mm_unpackhi_epi16(blueGreen, redAlpha);
+
+        auto address = reinterpret_cast<__m128i*>(target + i);
+        _mm_storeu_si128(address, blendPixels(_mm_loadu_si128(address), penWide, low));
+        _mm_storeu_si128(address + 1, blendPixels(_mm_loadu_si128(address + 1), penWide, high));
+    }
+    verticalScanlineScalar(target + i, red + i, green + i, blue + i, count - i, pen);
+}
+
+TARGET_SSE2 void monochromeScanlineSse2(
+    quint32* target, const unsigned char* bits, int firstBit, int count, quint32 pen)
+{
+    const auto& masks = monochromeMasks().masks;
+    const __m128i penVector = _mm_set1_epi32(static_cast<int>(pen));
+    bits += firstBit / 8;
+    int i = monochromeLeadingBits(target, bits, firstBit, count, pen);
+    if (i > 0) {
+        ++bits;
+    }
+    for (; i + 8 <= count; i += 8, ++bits) {
+        if (*bits == 0) {
+            continue;
+        }
+        auto address = reinterpret_cast<__m128i*>(target + i);
+        if (*bits == 0xff) {
+            _mm_storeu_si128(address, penVector);
+            _mm_storeu_si128(address + 1, penVector);
+            continue;
+        }
+        auto mask = reinterpret_cast<const __m128i*>(masks[*bits]);
+        for (int half = 0; half < 2; ++half) {
+            __m128i selection = _mm_load_si128(mask + half);
+            __m128i pixels = _mm_loadu_si128(address + half);
+            pixels = _mm_or_si128(_mm_and_si128(selection, penVector),
+                                  _mm_andnot_si128(selection, pixels));
+            _mm_storeu_si128(address + half, pixels);
+        }
+    }
+    if (i < count) {
+        monochromeTrailingBits(target + i, *bits, count - i, pen);
+    }
+}
+
+/*********/
+/* SSSE3 */
+/*********/
+
+/**
+ * Shuffle mask, which moves the interleaved sub-pixel coverage of four pixels to the byte order of
+ * the pixels: blue, green, red, alpha. The alpha byte is zeroed, so the alpha channel is kept.
+ */
+TARGET_SSSE3 inline __m128i subPixelShuffleMask(bool reversed)
+{
+    if (reversed) {
+        return _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    }
+    return _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+}
+
+/**
+ * Since 16 bytes are loaded for the 12 bytes of coverage of four pixels, the loop stops early
+ * enough to not read beyond the row.
+ */
+template <bool reversed>
+TARGET_SSSE3 void
+subPixelScanlineSsse3(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    const __m128i penWide
+        = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(pen)), _mm_setzero_si128());
+    const __m128i mask = subPixelShuffleMask(reversed);
+    int i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coverage + 3 * i));
+        values = _mm_shuffle_epi8(values, mask);
+        auto address = reinterpret_cast<__m128i*>(target + i);
+        _mm_storeu_si128(address, blendPixels(_mm_loadu_si128(address), penWide, values));
+    }
+    if (reversed) {
+        bgrScanlineScalar(target + i, coverage + 3 * i, count - i, pen);
+    } else {
+        rgbScanlineScalar(target + i, coverage + 3 * i, count - i, pen);
+    }
+}
+
+/********/
+/* AVX2 */
+/********/
+
+/**
+ * Blend sixteen 16 bit channels, see divideBy255 for the division.
+ */
+TARGET_AVX2 inline __m256i blendChannels(__m256i background, __m256i pen, __m256i coverage)
+{
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i value
+        = _mm256_add_epi16(_mm256_mullo_epi16(background, _mm256_sub_epi16(full, coverage)),
+                           _mm256_mullo_epi16(pen, coverage));
+    value = _mm256_add_epi16(value, _mm256_add_epi16(one, _mm256_srli_epi16(value, 8)));
+    return _mm256_srli_epi16(value, 8);
+}
+
+/**
+ * Blend eight pixels given the coverage replicated to all four bytes of a pixel. Unpacking and
+ * packing work within 128 bit lanes, so the pixel order is preserved.
+ */
+TARGET_AVX2 inline __m256i blendPixels(__m256i pixels, __m256i pen, __m256i coverage)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i low = blendChannels(_mm256_unpacklo_epi8(pixels, zero), pen,
+                                _mm256_unpacklo_epi8(coverage, zero));
+    __m256i high = blendChannels(_mm256_unpackhi_epi8(pixels, zero), pen,
+                                 _mm256_unpackhi_epi8(coverage, zero));
+    return _mm256_packus_epi16(low, high);
+}
+
+TARGET_AVX2 void
+grayScanlineAvx2(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    const __m256i penWide
+        = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(pen)), _mm256_setzero_si256());
+    const __m256i replicate = _mm256_set1_epi32(0x01010101);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        qint64 packed;
+        memcpy(&packed, coverage + i, sizeof(packed));
+        if (packed == 0) {
+            continue;
+        }
+        // widen every coverage byte to a 32 bit lane and replicate it to all four bytes
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(coverage + i));
+        __m256i values = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(bytes), replicate);
+
+        auto address = reinterpret_cast<__m256i*>(target + i);
+        _mm256_storeu_si256(address, blendPixels(_mm256_loadu_si256(address), penWide, values));
+    }
+    grayScanlineSse2(target + i, coverage + i, count - i, pen);
+}
+
+/**
+ * Like subPixelScanlineSsse3 for eight pixels. The shuffle works within 128 bit lanes, hence the
+ * coverage of the upper four pixels is loaded into the upper lane separately.
+ */
+template <bool reversed>
+TARGET_AVX2 void
+subPixelScanlineAvx2(quint32* target, const unsigned char* coverage, int count, quint32 pen)
+{
+    const __m256i penWide
+        = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(pen)), _mm256_setzero_si256());
+    const __m128i laneMask = subPixelShuffleMask(reversed);
+    const __m256i mask = _mm256_inserti128_si256(_mm256_castsi128_si256(laneMask), laneMask, 1);
+    int i = 0;
+    for (; i + 10 <= count; i += 8) {
+        auto source = reinterpret_cast<const __m128i*>(coverage + 3 * i);
+        auto sourceHigh = reinterpret_cast<const __m128i*>(coverage + 3 * i + 12);
+        __m256i values = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(source)), _mm_loadu_si128(sourceHigh), 1);
+        values = _mm256_shuffle_epi8(values, mask);
+        auto address = reinterpret_cast<__m256i*>(target + i);
+        _mm256_storeu_si256(address, blendPixels(_mm256_loadu_si256(address), penWide, values));
+    }
+    subPixelScanlineSsse3<reversed>(target + i, coverage + 3 * i, count - i, pen);
+}
+
+TARGET_AVX2 void verticalScanlineAvx2(quint32* target,
+                                      const unsigned char* red,
+                                      const unsigned char* green,
+                                      const unsigned char* blue,
+                                      int count,
+                                      quint32 pen)
+{
+    const __m256i penWide
+        = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(pen)), _mm256_setzero_si256());
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // widen every row to 32 bit lanes and combine them to the byte order of a pixel
+        auto redRow = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(red + i));
+        auto greenRow = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(green + i));
+        auto blueRow = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(blue + i));
+        __m256i r = _mm256_cvtepu8_epi32(redRow);
+        __m256i g = _mm256_cvtepu8_epi32(greenRow);
+        __m256i b = _mm256_cvtepu8_epi32(blueRow);
+        __m256i values = _mm256_or_si256(
+            b, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(r, 16)));
+
+        auto address = reinterpret_cast<__m256i*>(target + i);
+        _mm256_storeu_si256(address, blendPixels(_mm256_loadu_si256(address), penWide, values));
+    }
+    verticalScanlineSse2(target + i, red + i, green + i, blue + i, count - i, pen);
+}
+
+TARGET_AVX2 void monochromeScanlineAvx2(
+    quint32* target, const unsigned char* bits, int firstBit, int count, quint32 pen)
+{
+    const auto& masks = monochromeMasks().masks;
+    const __m256i penVector = _mm256_set1_epi32(static_cast<int>(pen));
+    bits += firstBit / 8;
+    int i = monochromeLeadingBits(target, bits, firstBit, count, pen);
+    if (i > 0) {
+        ++bits;
+    }
+    for (; i + 8 <= count; i += 8, ++bits) {
+        if (*bits == 0) {
+            continue;
+        }
+        auto address = reinterpret_cast<__m256i*>(target + i);
+        if (*bits == 0xff) {
+            _mm256_storeu_si256(address, penVector);
+            continue;
+        }
+        __m256i selection = _mm256_load_si256(reinterpret_cast<const __m256i*>(masks[*bits]));
+        _mm256_storeu_si256(address, _mm256_blendv_epi8(_mm256_loadu_si256(address), penVector,
+                                                         selection));
+    }
+    if (i < count) {
+        monochromeTrailingBits(target + i, *bits, count - i, pen);
+    }
+}
+
+#endif // BLEND_KERNELS_X86
+
+const BlendKernels scalarKernels = { BlendInstructionSet::Scalar, &grayScanlineScalar,
+                                     &rgbScanlineScalar,           &bgrScanlineScalar,
+                                     &verticalScanlineScalar,      &monochromeScanlineScalar };
+
+#ifdef BLEND_KERNELS_X86
+const BlendKernels sse2Kernels = { BlendInstructionSet::SSE2, &grayScanlineSse2,
+                                   &rgbScanlineScalar,         &bgrScanlineScalar,
+                                   &verticalScanlineSse2,      &monochromeScanlineSse2 };
+const BlendKernels ssse3Kernels = { BlendInstructionSet::SSSE3,   &grayScanlineSse2,
+                                    &subPixelScanlineSsse3<false>, &subPixelScanlineSsse3<true>,
+                                    &verticalScanlineSse2,         &monochromeScanlineSse2 };
+const BlendKernels avx2Kernels = { BlendInstructionSet::AVX2,     &grayScanlineAvx2,
+                                   &subPixelScanlineAvx2<false>, &subPixelScanlineAvx2<true>,
+                                   &verticalScanlineAvx2,        &monochromeScanlineAvx2 };
+#endif
+
+const BlendKernels& selectBestKernels()
+{
+    if (isBlendInstructionSetSupported(BlendInstructionSet::AVX2)) {
+        return blendKernels(BlendInstructionSet::AVX2);
+    }
+    if (isBlendInstructionSetSupported(BlendInstructionSet::SSSE3)) {
+        return blendKernels(BlendInstructionSet::SSSE3);
+    }
+    if (isBlendInstructionSetSupported(BlendInstructionSet::SSE2)) {
+        return blendKernels(BlendInstructionSet::SSE2);
+    }
+    return scalarKernels;
+}
+
+} // namespace
+
+bool isBlendInstructionSetSupported(BlendInstructionSet instructionSet)
+{
+    switch (instructionSet) {
+    case BlendInstructionSet::Scalar:
+        return true;
+#ifdef BLEND_KERNELS_X86
+    case BlendInstructionSet::SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case BlendInstructionSet::SSSE3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case BlendInstructionSet::AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const BlendKernels& blendKernels(BlendInstructionSet instructionSet)
+{
+    if (!isBlendInstructionSetSupported(instructionSet)) {
+        return scalarKernels;
+    }
+    switch (instructionSet) {
+#ifdef BLEND_KERNELS_X86
+    case BlendInstructionSet::SSE2:
+        return sse2Kernels;
+    case BlendInstructionSet::SSSE3:
+        return ssse3Kernels;
+    case BlendInstructionSet::AVX2:
+        return avx2Kernels;
+#endif
+    default:
+        return scalarKernels;
+    }
+}
+
+const BlendKernels& blendKernels()
+{
+    static const BlendKernels& best = selectBestKernels();
+    return best;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLENDKERNELS_H
+#define BLENDKERNELS_H
+
+#include <QtGlobal>
+
+/**
+ * @brief The BlendInstructionSet enum lists the available implementations of the blend kernels.
+ */
+enum class BlendInstructionSet { Scalar, SSE2, SSSE3, AVX2 };
+
+/**
+ * @brief GrayScanlineKernel blends a pen color onto a row of 32 bit pixels (0xAARRGGBB, as in
+ * QImage::Format_RGB32) using one coverage value per pixel.
+ *
+ * Every channel is computed as ((255 - coverage) * background + coverage * pen) / 255, which gives
+ * exactly the same result as blending pixel by pixel through QColor.
+ * @param target first pixel of the row
+ * @param coverage one value per pixel from 0 (not covered) to 255 (fully covered)
+ * @param count number of pixels
+ * @param pen color in 0xAARRGGBB
+ */
+typedef void (*GrayScanlineKernel)(quint32* target,
+                                   const unsigned char* coverage,
+                                   int count,
+                                   quint32 pen);
+
+/**
+ * @brief SubPixelScanlineKernel blends a pen color onto a row of 32 bit pixels using horizontally
+ * sub-pixel rendered coverage, i.e. three interleaved values per pixel from left to right.
+ *
+ * Every channel is blended independently with the coverage of its sub-pixel, see
+ * GrayScanlineKernel for the formula. The alpha channel is left untouched.
+ * @param target first pixel of the row
+ * @param coverage three values per pixel
+ * @param count number of pixels
+ * @param pen color in 0xAARRGGBB
+ */
+typedef void (*SubPixelScanlineKernel)(quint32* target,
+                                       const unsigned char* coverage,
+                                       int count,
+                                       quint32 pen);
+
+/**
+ * @brief VerticalSubPixelScanlineKernel blends a pen color onto a row of 32 bit pixels using
+ * vertically sub-pixel rendered coverage, where every sub-pixel has a row of its own.
+ *
+ * See SubPixelScanlineKernel for the blending. The caller maps the rows to the channels, which
+ * handles the reversed sub-pixel orders.
+ * @param target first pixel of the row
+ * @param red coverage of the red sub-pixels, one value per pixel
+ * @param green coverage of the green sub-pixels, one value per pixel
+ * @param blue coverage of the blue sub-pixels, one value per pixel
+ * @param count number of pixels
+ * @param pen color in 0xAARRGGBB
+ */
+typedef void (*VerticalSubPixelScanlineKernel)(quint32* target,
+                                               const unsigned char* red,
+                                               const unsigned char* green,
+                                               const unsigned char* blue,
+                                               int count,
+                                               quint32 pen);
+
+/**
+ * @brief MonochromeScanlineKernel paints a pen color onto a row of 32 bit pixels for every set
+ * bit of a monochrome bitmap row.
+ *
+ * Bits are stored in most significant bit order. Eight bits at a time are expanded to pixel masks
+ * through a 256 entry table, so whole spans are written at once.
+ * @param target pixel for the bit at position firstBit
+ * @param bits first byte of the bitmap row
+ * @param firstBit position of the first bit to paint
+ * @param count number of pixels
+ * @param pen color in 0xAARRGGBB
+ */
+typedef void (*MonochromeScanlineKernel)(quint32* target,
+                                         const unsigned char* bits,
+                                         int firstBit,
+                                         int count,
+                                         quint32 pen);
+
+/**
+ * @brief The BlendKernels struct bundles the kernels of one instruction set.
+ */
+struct BlendKernels
+{
+    BlendInstructionSet instructionSet;
+    GrayScanlineKernel grayScanline;
+
+    /**
+     * @brief rgbScanline handles the sub-pixel order red, green, blue from left to right.
+     */
+    SubPixelScanlineKernel rgbScanline;
+
+    /**
+     * @brief bgrScanline handles the sub-pixel order blue, green, red from left to right.
+     */
+    SubPixelScanlineKernel bgrScanline;
+
+    VerticalSubPixelScanlineKernel verticalScanline;
+
+    MonochromeScanlineKernel monochromeScanline;
+};
+
+/**
+ * @return true if the running CPU supports the instruction set
+ */
+bool isBlendInstructionSetSupported(BlendInstructionSet instructionSet);
+
+/**
+ * @brief blendKernels provides the kernels of a specific instruction set, e.g. for comparison.
+ * @return the requested kernels or the scalar ones, if the instruction set is not supported
+ */
+const BlendKernels& blendKernels(BlendInstructionSet instructionSet);
+
+/**
+ * @brief blendKernels provides the fastest kernels for the running CPU, which are selected once.
+ */
+const BlendKernels& blendKernels();
+
+#endif // BLENDKERNELS_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cancellation.h"
+
+namespace
+{
+static const int RENDER_STAGE_COUNT = static_cast<int>(RenderStage::Compose) + 1;
+
+QAtomicInteger<quint64> skippedStages[RENDER_STAGE_COUNT];
+}
+
+/*********************/
+/* RenderGenerations */
+/*********************/
+
+quint64 RenderGenerations::advance(const QString& key)
+{
+    QMutexLocker locker(&mutex);
+    return ++latest[key];
+}
+
+bool RenderGenerations::isLatest(const QString& key, quint64 generation) const
+{
+    QMutexLocker locker(&mutex);
+    return latest.value(key) == generation;
+}
+
+/*********************/
+/* CancellationToken */
+/*********************/
+
+CancellationToken::CancellationToken(RenderGenerations* generations, const QString& key)
+    : cancelled(0)
+    , generations(generations)
+    , key(key)
+    , generation(generations ? generations->advance(key) : 0)
+{
+}
+
+void CancellationToken::cancel()
+{
+    cancelled.storeRelease(1);
+}
+
+bool CancellationToken::isObsolete() const
+{
+    if (cancelled.loadAcquire()) {
+        return true;
+    }
+    return generations != nullptr && !generations->isLatest(key, generation);
+}
+
+bool CancellationToken::isSuperseded() const
+{
+    if (cancelled.loadAcquire()) {
+        return false;
+    }
+    return generations != nullptr && !generations->isLatest(key, generation);
+}
+
+bool CancellationToken::abandon(RenderStage stage) const
+{
+    if (!isObsolete()) {
+        return false;
+    }
+    skippedStages[static_cast<int>(stage)].fetchAndAddRelaxed(1);
+    return true;
+}
+
+bool CancellationToken::abandon(const CancellationToken* token, RenderStage stage)
+{
+    return token != nullptr && token->abandon(stage);
+}
+
+quint64 CancellationToken::getSkipped(RenderStage stage)
+{
+    return skippedStages[static_cast<int>(stage)].loadAcquire();
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+/**
+ * @brief The RenderStage enum lists the boundaries, at which a rendering can be abandoned.
+ */
+enum class RenderStage { Queued, Resolve, Shape, Raster, Compose };
+
+/**
+ * @brief The RenderGenerations class counts requests per key, so that older requests can
+ * recognize that they got superseded by a newer one.
+ */
+class RenderGenerations
+{
+private:
+    mutable QMutex mutex;
+    QHash<QString, quint64> latest;
+
+public:
+    /**
+     * @brief advance registers a new request.
+     * @param key identifies the requests, which supersede each other
+     * @return generation of the new request
+     */
+    quint64 advance(const QString& key);
+
+    /**
+     * @return true, if no request with the same key was registered after the given generation
+     */
+    bool isLatest(const QString& key, quint64 generation) const;
+};
+
+/**
+ * @brief The CancellationToken class tells a rendering, whether its result is still needed.
+ *
+ * A token is either cancelled explicitly or it becomes stale, as soon as a newer request with the
+ * same key is registered at the given @ref RenderGenerations. Renderings check the token at stage
+ * boundaries with @ref abandon, which also counts the skipped stages process wide.
+ */
+class CancellationToken
+{
+private:
+    QAtomicInt cancelled;
+    RenderGenerations* generations;
+    const QString key;
+    const quint64 generation;
+
+public:
+    /**
+     * @brief CancellationToken constructor registers a new request.
+     * @param generations the token becomes stale, when a newer request of the same key is
+     *        registered, it has to outlive the token. Without, only cancel makes it obsolete.
+     * @param key identifies the requests, which supersede each other
+     */
+    explicit CancellationToken(RenderGenerations* generations = nullptr,
+                               const QString& key = QString());
+
+    CancellationToken& operator=(const CancellationToken&) = delete;
+    CancellationToken(const CancellationToken&) = delete;
+
+    /**
+     * @brief cancel marks the rendering as obsolete, may be called from any thread.
+     */
+    void cancel();
+
+    /**
+     * @return true, if the token was cancelled or a newer request superseded it
+     */
+    bool isObsolete() const;
+
+    /**
+     * @return true, if a newer request superseded the token, while it was not cancelled
+     */
+    bool isSuperseded() const;
+
+    /**
+     * @brief abandon checks the token before entering a stage.
+     * @param stage which would be conducted next
+     * @return true, if the rendering should be abandoned, the stage is then counted as skipped
+     */
+    bool abandon(RenderStage stage) const;
+
+    /**
+     * @brief abandon is a convenience function for optional tokens.
+     * @return false for nullptr, see @ref abandon otherwise
+     */
+    static bool abandon(const CancellationToken* token, RenderStage stage);
+
+    /**
+     * @return number of renderings abandoned before the given stage, in this process
+     */
+    static quint64 getSkipped(RenderStage stage);
+};
+
+#endif // CANCELLATION_H
@@ -20,13 +20,16 @@
  */
 
 #include "freetype-renderer.h"
+#include "trace.h"
 
 extern "C" {
 #include <hb-ft.h>
+#include <hb-ot.h>
 }
 
 #include <QMap>
 #include <QPainter>
+#include <QThreadStorage>
 #include <QtMath>
 
 /** FreeType divides a pixel into 64 parts */
@@ -35,28 +38,79 @@ extern "C" {
 /** FreeType uses typographic points defined as 1/72 inch */
 #define TYPOGRAHIC_POINTS_PER_INCH 72.0
 
+/** Minimal interval in milliseconds between checks for a changed Fontconfig configuration */
+#define FONTCONFIG_UPTODATE_INTERVAL 2000
+
+/************/
+/* FontFile */
+/************/
+
+FontFile::FontFile(const QByteArray& path, int faceIndex) : path(path), faceIndex(faceIndex)
+{
+}
+
+bool FontFile::isValid() const
+{
+    return !path.isEmpty();
+}
+
 /******************/
 /* FontManagement */
 /******************/
 
-FontManagement::FontManagement() : fontConfig{ nullptr }
+FontManagement::FontManagement() : fontConfig{ nullptr }, cacheHits(0), cacheMisses(0)
 {
     FcBool fontconfigInit = FcInit();
     if (fontconfigInit == FcTrue) {
         fontConfig = FcInitLoadConfigAndFonts();
     }
+    lastUptoDateCheck.start();
 }
 
 FontManagement::~FontManagement()
 {
     if (fontConfig)
-        free(fontConfig);
+        FcConfigDestroy(fontConfig);
+}
+
+FontManagement& FontManagement::instance()
+{
+    static FontManagement sharedInstance;
+    return sharedInstance;
 }
 
-const char* FontManagement::retrievePath(const char* font)
+QSharedPointer<const FontFile> FontManagement::retrievePath(const char* font)
 {
+    QMutexLocker locker(&mutex);
+    invalidateIfOutdated();
+
     auto pattern = FcNameParse(reinterpret_cast<const FcChar8*>(font));
-    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    if (pattern == nullptr) {
+        return QSharedPointer<const FontFile>::create(QByteArray());
+    }
+
+    // normalize the pattern, so that equivalent names share one cache entry
+    FcChar8* unparsed = FcNameUnparse(pattern);
+    QByteArray key(reinterpret_cast<const char*>(unparsed));
+    free(unparsed);
+
+    auto cached = resolutionCache.constFind(key);
+    if (cached != resolutionCache.constEnd()) {
+        ++cacheHits;
+        FcPatternDestroy(pattern);
+        return cached.value();
+    }
+
+    ++cacheMisses;
+    auto result = resolve(pattern);
+    FcPatternDestroy(pattern);
+    resolutionCache.insert(key, result);
+    return result;
+}
+
+QSharedPointer<const FontFile> FontManagement::resolve(FcPattern* pattern)
+{
+    FcConfigSubstitute(fontConfig, pattern, FcMatchPattern);
     FcDefaultSubstitute(pattern);
 
     // actual font substitution
@@ -64,33 +118,65 @@ const char* FontManagement::retrievePath(const char* font)
     auto match = FcFontMatch(fontConfig, pattern, &fcResult);
     if (fcResult != FcResultMatch) {
         FcPatternDestroy(match);
-        return "";
+        return QSharedPointer<const FontFile>::create(QByteArray());
     }
 
     // grab font file path from result
     FcChar8* fontFacePath;
     if (FcPatternGetString(match, FC_FILE, 0, &fontFacePath) != FcResultMatch) {
-        FcPatternDestroy(pattern);
         FcPatternDestroy(match);
-        return "";
+        return QSharedPointer<const FontFile>::create(QByteArray());
+    }
+
+    // font collections contain several faces
+    int faceIndex;
+    if (FcPatternGetInteger(match, FC_INDEX, 0, &faceIndex) != FcResultMatch) {
+        faceIndex = 0;
     }
 
-    // pull out path
-    auto path = copyFcString(fontFacePath);
+    // pull out path, which is copied before the match is destroyed
+    auto result = QSharedPointer<const FontFile>::create(
+        QByteArray(reinterpret_cast<const char*>(fontFacePath)), faceIndex);
 
     // and clean up
-    FcPatternDestroy(pattern);
     FcPatternDestroy(match);
 
-    return path;
+    return result;
 }
 
-const char* FontManagement::copyFcString(const FcChar8* fcString)
+void FontManagement::invalidateIfOutdated()
 {
-    const char* tmp = reinterpret_cast<const char*>(fcString);
-    char* result = new char[strlen(tmp) + 1];
-    strcpy(result, tmp);
-    return result;
+    if (lastUptoDateCheck.elapsed() < FONTCONFIG_UPTODATE_INTERVAL) {
+        return;
+    }
+    lastUptoDateCheck.restart();
+
+    if (fontConfig == nullptr || FcConfigUptoDate(fontConfig) == FcTrue) {
+        return;
+    }
+
+    // configuration or font directories changed: start over
+    FcConfigDestroy(fontConfig);
+    fontConfig = FcInitLoadConfigAndFonts();
+    resolutionCache.clear();
+}
+
+void FontManagement::clear()
+{
+    QMutexLocker locker(&mutex);
+    resolutionCache.clear();
+}
+
+quint64 FontManagement::getCacheHits() const
+{
+    QMutexLocker locker(&mutex);
+    return cacheHits;
+}
+
+quint64 FontManagement::getCacheMisses() const
+{
+    QMutexLocker locker(&mutex);
+    return cacheMisses;
 }
 
 /**********************/
@@ -154,11 +240,36 @@ FreeTypeParameters::FreeTypeParameters(KXftConfig options)
     }
 }
 
+/************/
+/* CharSize */
+/************/
+
+CharSize::CharSize(long charSize, uint dpiH, uint dpiV)
+    : charSize(charSize), dpiH(dpiH), dpiV(dpiV)
+{
+}
+
+bool CharSize::operator==(const CharSize& other) const
+{
+    return charSize == other.charSize && dpiH == other.dpiH && dpiV == other.dpiV;
+}
+
+uint qHash(const CharSize& key, uint seed)
+{
+    return qHash(static_cast<qint64>(key.charSize), seed) ^ qHash(key.dpiH, seed) * 31
+           ^ qHash(key.dpiV, seed) * 37;
+}
+
 /*******************/
 /* FreeTypeLibrary */
 /*******************/
 
-FreeTypeLibrary::FreeTypeLibrary() : freetypeLib{ nullptr }
+FreeTypeLibrary::FreeTypeLibrary(int maxFaces, int maxSizesPerFace)
+    : freetypeLib{ nullptr }
+    , maxFaces(qMax(1, maxFaces))
+    , maxSizesPerFace(qMax(1, maxSizesPerFace))
+    , faceRequests(0)
+    , faceReuses(0)
 {
     FT_Error freetypeInit = FT_Init_FreeType(&freetypeLib);
     if (freetypeInit != 0) {
@@ -168,18 +279,178 @@ FreeTypeLibrary::FreeTypeLibrary() : freetypeLib{ nullptr }
 
 FreeTypeLibrary::~FreeTypeLibrary()
 {
+    closeFaces();
+    for (auto buffer : bufferPool) {
+        hb_buffer_destroy(buffer);
+    }
+    bufferPool.clear();
     FT_Done_FreeType(freetypeLib);
     freetypeLib = nullptr;
 }
 
-FT_Face FreeTypeLibrary::getFontFace(const char* path)
+FreeTypeLibrary& FreeTypeLibrary::forCurrentThread()
 {
-    FT_Face fontFace;
-    auto error = FT_New_Face(freetypeLib, path, 0, &fontFace);
-    if (error) {
-        // FIXME
+    static QThreadStorage<FreeTypeLibrary*> libraries;
+    if (!libraries.hasLocalData()) {
+        libraries.setLocalData(new FreeTypeLibrary());
+    }
+    return *libraries.localData();
+}
+
+void FreeTypeLibrary::closeFace(CachedFace* cachedFace)
+{
+    // the Harfbuzz fonts of the sizes reference the Harfbuzz face, which references the FreeType
+    // face, hence the sizes have to go first, otherwise the face would never be released
+    for (const auto& cachedSize : cachedFace->sizes) {
+        FT_Done_Size(cachedSize.size);
+    }
+    if (cachedFace->face->size != nullptr && cachedFace->face->size->generic.data != nullptr) {
+        destroyHarfbuzzFont(cachedFace->face->size);
+    }
+    if (cachedFace->harfbuzzFace != nullptr) {
+        hb_face_destroy(cachedFace->harfbuzzFace);
+    }
+    FT_Done_Face(cachedFace->face);
+    delete cachedFace;
+}
+
+void FreeTypeLibrary::closeFaces()
+{
+    for (auto cachedFace : faces) {
+        closeFace(cachedFace);
+    }
+    faces.clear();
+}
+
+FT_Face FreeTypeLibrary::getFontFace(const FontFile& fontFile, const CharSize& size)
+{
+    ++faceRequests;
+
+    CachedFace* cachedFace = nullptr;
+    for (int i = 0; i < faces.size(); ++i) {
+        if (faces[i]->faceIndex == fontFile.faceIndex && faces[i]->path == fontFile.path) {
+            cachedFace = faces[i];
+            faces.move(i, 0);
+            ++faceReuses;
+            break;
+        }
+    }
+
+    if (cachedFace == nullptr) {
+        FT_Face fontFace;
+        auto error
+            = FT_New_Face(freetypeLib, fontFile.path.constData(), fontFile.faceIndex, &fontFace);
+        if (error) {
+            return nullptr;
+        }
+        cachedFace = new CachedFace{ fontFile.path, fontFile.faceIndex, fontFace, {}, nullptr };
+        faces.prepend(cachedFace);
+        while (faces.size() > maxFaces) {
+            closeFace(faces.takeLast());
+        }
+    }
+
+    auto& sizes = cachedFace->sizes;
+    for (int i = 0; i < sizes.size(); ++i) {
+        if (sizes[i].charSize == size) {
+            sizes.move(i, 0);
+            FT_Activate_Size(sizes.first().size);
+            return cachedFace->face;
+        }
+    }
+
+    FT_Size ftSize;
+    if (FT_New_Size(cachedFace->face, &ftSize)) {
+        return nullptr;
+    }
+    FT_Activate_Size(ftSize);
+    FT_Set_Char_Size(cachedFace->face, 0, size.charSize, size.dpiH, size.dpiV);
+    sizes.prepend(CachedSize{ size, ftSize });
+    while (sizes.size() > maxSizesPerFace) {
+        FT_Done_Size(sizes.takeLast().size);
+    }
+    // the evicted size might have been the active one
+    FT_Activate_Size(ftSize);
+
+    return cachedFace->face;
+}
+
+void FreeTypeLibrary::destroyHarfbuzzFont(void* object)
+{
+    auto size = static_cast<FT_Size>(object);
+    hb_font_destroy(static_cast<hb_font_t*>(size->generic.data));
+    size->generic.data = nullptr;
+}
+
+hb_font_t* FreeTypeLibrary::getHarfbuzzFont(FT_Face face)
+{
+    auto size = face->size;
+    if (size->generic.data != nullptr) {
+        return static_cast<hb_font_t*>(size->generic.data);
+    }
+
+    CachedFace* cachedFace = nullptr;
+    for (auto candidate : faces) {
+        if (candidate->face == face) {
+            cachedFace = candidate;
+            break;
+        }
     }
-    return fontFace;
+    if (cachedFace == nullptr) {
+        return nullptr;
+    }
+    if (cachedFace->harfbuzzFace == nullptr) {
+        cachedFace->harfbuzzFace = hb_ft_face_create_referenced(face);
+    }
+
+    // scaled in 26.6 pixels like hb_ft_font_create, metrics are taken from the font tables
+    auto font = hb_font_create(cachedFace->harfbuzzFace);
+    hb_ot_font_set_funcs(font);
+    auto unitsPerEM = static_cast<quint64>(face->units_per_EM);
+    auto xScale = (static_cast<quint64>(size->metrics.x_scale) * unitsPerEM + (1u << 15)) >> 16;
+    auto yScale = (static_cast<quint64>(size->metrics.y_scale) * unitsPerEM + (1u << 15)) >> 16;
+    hb_font_set_scale(font, static_cast<int>(xScale), static_cast<int>(yScale));
+    hb_font_set_ppem(font, size->metrics.x_ppem, size->metrics.y_ppem);
+
+    size->generic.data = font;
+    size->generic.finalizer = &FreeTypeLibrary::destroyHarfbuzzFont;
+    return font;
+}
+
+hb_buffer_t* FreeTypeLibrary::acquireBuffer()
+{
+    if (bufferPool.isEmpty()) {
+        return hb_buffer_create();
+    }
+    return bufferPool.takeLast();
+}
+
+void FreeTypeLibrary::releaseBuffer(hb_buffer_t* buffer)
+{
+    hb_buffer_clear_contents(buffer);
+    bufferPool.append(buffer);
+}
+
+int FreeTypeLibrary::getOpenFaceCount() const
+{
+    return faces.size();
+}
+
+quint64 FreeTypeLibrary::getFaceRequests() const
+{
+    return faceRequests;
+}
+
+quint64 FreeTypeLibrary::getFaceReuses() const
+{
+    return faceReuses;
+}
+
+double FreeTypeLibrary::getReuseRatio() const
+{
+    if (faceRequests == 0)
+        return 0;
+    return static_cast<double>(faceReuses) / faceRequests;
 }
 
 long FreeTypeLibrary::convertPointSize(double point_size)
@@ -187,6 +458,92 @@ long FreeTypeLibrary::convertPointSize(double point_size)
     return static_cast<long>(point_size * PIXEL_FRACTION_FACTOR);
 }
 
+/****************/
+/* ShapedRunKey */
+/****************/
+
+ShapedRunKey::ShapedRunKey(const QByteArray& text,
+                           const FontFile& fontFile,
+                           const CharSize& size,
+                           uint ppemX,
+                           uint ppemY,
+                           const QByteArray& features)
+    : text(text)
+    , path(fontFile.path)
+    , faceIndex(fontFile.faceIndex)
+    , size(size)
+    , ppemX(ppemX)
+    , ppemY(ppemY)
+    , features(features)
+{
+}
+
+bool ShapedRunKey::operator==(const ShapedRunKey& other) const
+{
+    return text == other.text && faceIndex == other.faceIndex && size == other.size
+           && ppemX == other.ppemX && ppemY == other.ppemY && path == other.path
+           && features == other.features;
+}
+
+uint qHash(const ShapedRunKey& key, uint seed)
+{
+    return qHash(key.text, seed) ^ qHash(key.path, seed) * 31 ^ qHash(key.size, seed) * 37
+           ^ qHash(key.faceIndex ^ key.ppemX << 8 ^ key.ppemY << 20, seed)
+           ^ qHash(key.features, seed);
+}
+
+/******************/
+/* ShapedRunCache */
+/******************/
+
+ShapedRunCache::ShapedRunCache(int maxGlyphs) : cache(maxGlyphs), hits(0), misses(0)
+{
+}
+
+ShapedRunCache& ShapedRunCache::instance()
+{
+    static ShapedRunCache sharedCache;
+    return sharedCache;
+}
+
+bool ShapedRunCache::find(const ShapedRunKey& key, QVector<ShapedGlyph>* run)
+{
+    QMutexLocker locker(&mutex);
+    auto cached = cache.object(key);
+    if (cached == nullptr) {
+        ++misses;
+        return false;
+    }
+    ++hits;
+    *run = *cached;
+    return true;
+}
+
+void ShapedRunCache::insert(const ShapedRunKey& key, const QVector<ShapedGlyph>& run)
+{
+    QMutexLocker locker(&mutex);
+    // the cost of an empty run must not be zero, otherwise they would pile up
+    cache.insert(key, new QVector<ShapedGlyph>(run), qMax(1, run.size()));
+}
+
+void ShapedRunCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    cache.clear();
+}
+
+quint64 ShapedRunCache::getHits()
+{
+    QMutexLocker locker(&mutex);
+    return hits;
+}
+
+quint64 ShapedRunCache::getMisses()
+{
+    QMutexLocker locker(&mutex);
+    return misses;
+}
+
 /***************/
 /* RasterGlyph */
 /***************/
@@ -199,6 +556,11 @@ RasteredGlyph::RasteredGlyph(FT_Bitmap* bitmap, uint width, uint height)
 {
 }
 
+GlyphRaster RasteredGlyph::raster(const unsigned char* buffer) const
+{
+    return GlyphRaster{ buffer, pitch, static_cast<int>(width), static_cast<int>(height) };
+}
+
 unsigned int RasteredGlyph::getHeight() const
 {
     return height;
@@ -214,54 +576,22 @@ unsigned int RasteredGlyph::getWidth() const
 /*******************/
 
 MonochromeGlyph::MonochromeGlyph(FT_Bitmap* bitmap)
-    : RasteredGlyph(bitmap, bitmap->width, bitmap->rows)
-{
-    auto size = height * rowLength;
-    this->bitmap = new unsigned char[size]();
-    memcpy(this->bitmap, bitmap->buffer, size);
-}
-
-MonochromeGlyph::~MonochromeGlyph()
+    : RasteredGlyph(bitmap, bitmap->width, bitmap->rows), bitmap(bitmap->buffer)
 {
-    delete[] bitmap;
 }
 
-inline int MonochromeGlyph::pixelAt(uint x, uint y, int pitch, const unsigned char* buffer)
+void MonochromeGlyph::paint(QImage* canvas, int x, int y, const QColor& pen) const
 {
-    uint index = y * static_cast<uint>(abs(pitch)) + x / 8;
-    uint position = 7 - x % 8;
-    unsigned char byte = buffer[index];
-    return byte >> position & 0x1;
-}
-
-void MonochromeGlyph::paint(QImage* canvas, int x, int y, const QColor& pen)
-{
-    for (uint glyphY = 0; glyphY < height; glyphY++) {
-        for (uint glyphX = 0; glyphX < width; glyphX++) {
-            if (pixelAt(glyphX, glyphY, pitch, bitmap)) {
-                int cursorX = static_cast<int>(glyphX) + x;
-                int cursorY = static_cast<int>(glyphY) + y;
-                canvas->setPixel(cursorX, cursorY, pen.rgb());
-            }
-        }
-    }
+    GlyphPainter(canvas, pen).paint(GlyphLayout::Monochrome, raster(bitmap), x, y);
 }
 
 /*****************/
 /* ByteDataGlyph */
 /*****************/
 
-ByteDataGlyph::ByteDataGlyph(FT_Bitmap* bitmap, uint bytesPerPixel, uint width, uint height)
-    : RasteredGlyph(bitmap, width, height)
-{
-    const char* buffer = reinterpret_cast<const char*>(bitmap->buffer);
-    auto size = static_cast<int>(height * rowLength * bytesPerPixel);
-    bytemap = new QByteArray(buffer, size);
-}
-
-ByteDataGlyph::~ByteDataGlyph()
+ByteDataGlyph::ByteDataGlyph(FT_Bitmap* bitmap, uint width, uint height)
+    : RasteredGlyph(bitmap, width, height), bytemap(bitmap->buffer)
 {
-    delete bytemap;
 }
 
 /******************/
@@ -269,83 +599,40 @@ ByteDataGlyph::~ByteDataGlyph()
 /******************/
 
 GrayScaleGlyph::GrayScaleGlyph(FT_Bitmap* bitmap)
-    : ByteDataGlyph(bitmap, 1, bitmap->width, bitmap->rows)
+    : ByteDataGlyph(bitmap, bitmap->width, bitmap->rows)
 {
 }
 
-void GrayScaleGlyph::paint(QImage* canvas, int x, int y, const QColor& pen)
+void GrayScaleGlyph::paint(QImage* canvas, int x, int y, const QColor& pen) const
 {
-    int pen_r, pen_g, pen_b;
-    pen.getRgb(&pen_r, &pen_g, &pen_b);
-    for (int j = 0; static_cast<uint>(j) < height; ++j) {
-        for (int i = 0; static_cast<uint>(i) < width; ++i) {
-            int cursor_x = i + x;
-            int cursor_y = j + y;
-
-            auto value = static_cast<unsigned char>(bytemap->at(j * pitch + i));
-
-            int backgound_r, backgound_g, backgound_b;
-            canvas->pixelColor(cursor_x, cursor_y).getRgb(&backgound_r, &backgound_g, &backgound_b);
-
-            int result_r = ((255 - value) * backgound_r + value * pen_r) / 255;
-            int result_g = ((255 - value) * backgound_g + value * pen_g) / 255;
-            int result_b = ((255 - value) * backgound_b + value * pen_b) / 255;
-            canvas->setPixel(cursor_x, cursor_y, qRgb(result_r, result_g, result_b));
-        }
-    }
+    GlyphPainter(canvas, pen).paint(GlyphLayout::GrayScale, raster(bytemap), x, y);
 }
 
 /*************************/
 /* AbstractSubPixelGlyph */
 /*************************/
 
-AbstractSubPixelGlyph::AbstractSubPixelGlyph(
-    FT_Bitmap* bitmap, uint bytesPerPixel, uint width, uint height, bool reversed)
-    : ByteDataGlyph(bitmap, bytesPerPixel, width, height), reverse(reversed)
+AbstractSubPixelGlyph::AbstractSubPixelGlyph(FT_Bitmap* bitmap,
+                                             uint width,
+                                             uint height,
+                                             bool reversed)
+    : ByteDataGlyph(bitmap, width, height), reverse(reversed)
 {
 }
 
-void AbstractSubPixelGlyph::paint(QImage* canvas, int x, int y, const QColor& pen)
-{
-    int pen_r, pen_g, pen_b;
-    pen.getRgb(&pen_r, &pen_g, &pen_b);
-
-    int offset_r = reverse ? 2 : 0;
-    int offset_g = 1;
-    int offset_b = reverse ? 0 : 2;
-
-    for (int j = 0; static_cast<uint>(j) < height; ++j) {
-        for (int i = 0; static_cast<uint>(i) < width; ++i) {
-            int cursor_x = i + x;
-            int cursor_y = j + y;
-
-            int backgound_r, backgound_g, backgound_b;
-            canvas->pixelColor(cursor_x, cursor_y).getRgb(&backgound_r, &backgound_g, &backgound_b);
-
-            unsigned char value_r = getValue(j, i, offset_r);
-            unsigned char value_g = getValue(j, i, offset_g);
-            unsigned char value_b = getValue(j, i, offset_b);
-
-            int result_r = ((255 - value_r) * backgound_r + value_r * pen_r) / 255;
-            int result_g = ((255 - value_g) * backgound_g + value_g * pen_g) / 255;
-            int result_b = ((255 - value_b) * backgound_b + value_b * pen_b) / 255;
-            canvas->setPixel(cursor_x, cursor_y, qRgb(result_r, result_g, result_b));
-        }
-    }
-}
-
 /*****************/
 /* SubPixelGlyph */
 /*****************/
 
 SubPixelGlyph::SubPixelGlyph(FT_Bitmap* bitmap, bool reversed)
-    : AbstractSubPixelGlyph(bitmap, 3, bitmap->width / 3, bitmap->rows, reversed)
+    : AbstractSubPixelGlyph(bitmap, bitmap->width / 3, bitmap->rows, reversed)
 {
 }
 
-inline unsigned char SubPixelGlyph::getValue(int row, int column, int subPixelOffset)
+void SubPixelGlyph::paint(QImage* canvas, int x, int y, const QColor& pen) const
 {
-    return static_cast<unsigned char>(bytemap->at(row * pitch + 3 * column + subPixelOffset));
+    auto layout = reverse ? GlyphLayout::Bgr : GlyphLayout::Rgb;
+    GlyphPainter(canvas, pen).paint(layout, raster(bytemap), x, y);
 }
 
 /*************************/
@@ -353,52 +640,251 @@ inline unsigned char SubPixelGlyph::getValue(int row, int column, int subPixelOf
 /*************************/
 
 VerticalSubPixelGlyph::VerticalSubPixelGlyph(FT_Bitmap* bitmap, bool reversed)
-    : AbstractSubPixelGlyph(bitmap, 3, bitmap->width, bitmap->rows / 3, reversed)
+    : AbstractSubPixelGlyph(bitmap, bitmap->width, bitmap->rows / 3, reversed)
 {
 }
 
-inline unsigned char VerticalSubPixelGlyph::getValue(int row, int column, int subPixelOffset)
+void VerticalSubPixelGlyph::paint(QImage* canvas, int x, int y, const QColor& pen) const
 {
-    return static_cast<unsigned char>(bytemap->at((3 * row + subPixelOffset) * pitch + column));
+    auto layout = reverse ? GlyphLayout::VerticalBgr : GlyphLayout::VerticalRgb;
+    GlyphPainter(canvas, pen).paint(layout, raster(bytemap), x, y);
 }
 
-/*************/
-/* GlyphData */
-/*************/
+/************/
+/* GlyphKey */
+/************/
+
+GlyphKey::GlyphKey(const FontFile& fontFile,
+                   const CharSize& size,
+                   quint32 glyphIndex,
+                   int loadFlags,
+                   FT_Render_Mode renderMode,
+                   bool reversedSubpixel)
+    : path(fontFile.path)
+    , faceIndex(fontFile.faceIndex)
+    , size(size)
+    , glyphIndex(glyphIndex)
+    , loadFlags(loadFlags)
+    , renderMode(renderMode)
+    , reversedSubpixel(reversedSubpixel)
+{
+}
+
+bool GlyphKey::operator==(const GlyphKey& other) const
+{
+    return glyphIndex == other.glyphIndex && loadFlags == other.loadFlags
+           && renderMode == other.renderMode && reversedSubpixel == other.reversedSubpixel
+           && faceIndex == other.faceIndex && size == other.size && path == other.path;
+}
 
-GlyphData::GlyphData(hb_glyph_position_t* glyphPos,
-                     FT_GlyphSlotRec* glyphData,
-                     bool reversedSubpixel)
-    : offsetX(static_cast<float>(glyphPos->x_offset) / PIXEL_FRACTION_FACTOR)
-    , offsetY(static_cast<float>(glyphPos->y_offset) / PIXEL_FRACTION_FACTOR)
-    , advanceX(static_cast<float>(glyphPos->x_advance) / PIXEL_FRACTION_FACTOR)
-    , advanceY(static_cast<float>(glyphPos->y_advance) / PIXEL_FRACTION_FACTOR)
-    , bearingLeft(glyphData->bitmap_left)
+uint qHash(const GlyphKey& key, uint seed)
+{
+    uint mode = static_cast<uint>(key.renderMode) << 1 | (key.reversedSubpixel ? 1 : 0);
+    return qHash(key.path, seed) ^ qHash(key.size, seed) * 31
+           ^ qHash(key.glyphIndex ^ mode << 24, seed) * 37
+           ^ qHash(key.loadFlags ^ key.faceIndex << 24, seed);
+}
+
+/***************/
+/* GlyphBitmap */
+/***************/
+
+GlyphBitmap::GlyphBitmap(FT_GlyphSlotRec* glyphData,
+                         bool reversedSubpixel,
+                         const AtlasRegion& region)
+    : bearingLeft(glyphData->bitmap_left)
     , bearingTop(glyphData->bitmap_top)
-    , pixelData{ nullptr }
+    , pixelMode(glyphData->bitmap.pixel_mode)
+    , bitmapWidth(region.isNull() ? 0 : glyphData->bitmap.width)
+    , bitmapRows(region.isNull() ? 0 : glyphData->bitmap.rows)
+    , region(region)
+    , layout(GlyphLayout::GrayScale)
 {
+    if (region.isNull())
+        return;
 
-    switch (glyphData->bitmap.pixel_mode) {
+    // the atlas only holds glyphs of supported pixel modes
+    GlyphPainter::layout(static_cast<FT_Pixel_Mode>(pixelMode), reversedSubpixel, &layout);
+
+    // copy rows top down, FreeType stores bitmaps with negative pitch bottom up
+    const auto& bitmap = glyphData->bitmap;
+    auto rows = static_cast<int>(bitmap.rows);
+    auto rowLength = static_cast<size_t>(region.rect.width());
+    for (int row = 0; row < rows; ++row) {
+        int sourceRow = bitmap.pitch >= 0 ? row : rows - 1 - row;
+        const unsigned char* source = bitmap.buffer + sourceRow * abs(bitmap.pitch);
+        auto target = region.page->scanLine(region.rect.y() + row) + region.rect.x();
+        memcpy(target, source, rowLength);
+    }
+}
+
+int GlyphBitmap::requiredBytesPerRow(const FT_Bitmap& bitmap)
+{
+    switch (bitmap.pixel_mode) {
     case FT_PIXEL_MODE_MONO:
-        pixelData = new MonochromeGlyph(&glyphData->bitmap);
-        break;
+        return static_cast<int>((bitmap.width + 7) / 8);
     case FT_PIXEL_MODE_GRAY:
-        pixelData = new GrayScaleGlyph(&glyphData->bitmap);
-        break;
     case FT_PIXEL_MODE_LCD:
-        pixelData = new SubPixelGlyph(&glyphData->bitmap, reversedSubpixel);
-        break;
     case FT_PIXEL_MODE_LCD_V:
-        pixelData = new VerticalSubPixelGlyph(&glyphData->bitmap, reversedSubpixel);
-        break;
+        // the width of sub-pixel rendered bitmaps is given in bytes already
+        return static_cast<int>(bitmap.width);
     case FT_PIXEL_MODE_BGRA:
         // TODO color emoji support
         // Hint: bitmap would be pre-multiplied sRGB image in BGRA order
         //       see FT_PIXEL_MODE_BGRA in FreeType docs
-        break;
+    default:
+        return 0;
     }
 }
 
+float GlyphBitmap::getBearingLeft() const
+{
+    return bearingLeft;
+}
+
+float GlyphBitmap::getBearingTop() const
+{
+    return bearingTop;
+}
+
+unsigned int GlyphBitmap::getWidth() const
+{
+    if (pixelMode == FT_PIXEL_MODE_LCD)
+        return bitmapWidth / 3;
+    return bitmapWidth;
+}
+
+unsigned int GlyphBitmap::getHeight() const
+{
+    if (pixelMode == FT_PIXEL_MODE_LCD_V)
+        return bitmapRows / 3;
+    return bitmapRows;
+}
+
+AtlasPage* GlyphBitmap::getPage() const
+{
+    return region.page.data();
+}
+
+void GlyphBitmap::paint(const GlyphPainter& painter, int x, int y) const
+{
+    if (region.isNull())
+        return;
+
+    auto buffer = region.page->scanLine(region.rect.y()) + region.rect.x();
+    GlyphRaster raster{ buffer, region.page->getWidth(), static_cast<int>(getWidth()),
+                        static_cast<int>(getHeight()) };
+    painter.paint(layout, raster, x, y);
+}
+
+/**************/
+/* GlyphCache */
+/**************/
+
+GlyphCache::GlyphCache(int maxBytes) : atlas(maxBytes), hits(0), misses(0)
+{
+}
+
+GlyphCache& GlyphCache::instance()
+{
+    static GlyphCache sharedCache;
+    return sharedCache;
+}
+
+QSharedPointer<const GlyphBitmap> GlyphCache::find(const GlyphKey& key)
+{
+    QMutexLocker locker(&mutex);
+    auto cached = glyphs.value(key);
+    if (cached.isNull()) {
+        ++misses;
+        return cached;
+    }
+    ++hits;
+    if (cached->getPage() != nullptr) {
+        atlas.touch(cached->getPage());
+    }
+    return cached;
+}
+
+AtlasRegion GlyphCache::allocate(const FT_Bitmap& bitmap)
+{
+    int width = GlyphBitmap::requiredBytesPerRow(bitmap);
+    int height = static_cast<int>(bitmap.rows);
+    if (width == 0 || height == 0) {
+        return AtlasRegion();
+    }
+
+    auto pixelMode = static_cast<FT_Pixel_Mode>(bitmap.pixel_mode);
+    auto region = atlas.allocate(pixelMode, width, height);
+    while (region.isNull()) {
+        // budget exhausted: drop the oldest page with all its glyphs
+        auto evicted = atlas.evictLeastRecentlyUsedPage();
+        for (auto it = glyphs.begin(); it != glyphs.end();) {
+            if (it.value()->getPage() == evicted.data()) {
+                it = glyphs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        region = atlas.allocate(pixelMode, width, height);
+    }
+    return region;
+}
+
+QSharedPointer<const GlyphBitmap>
+GlyphCache::insert(const GlyphKey& key, FT_GlyphSlotRec* glyphData, bool reversedSubpixel)
+{
+    QMutexLocker locker(&mutex);
+    auto region = allocate(glyphData->bitmap);
+    auto glyph = QSharedPointer<const GlyphBitmap>::create(glyphData, reversedSubpixel, region);
+    glyphs.insert(key, glyph);
+    return glyph;
+}
+
+void GlyphCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    glyphs.clear();
+    atlas.clear();
+}
+
+quint64 GlyphCache::getHits()
+{
+    QMutexLocker locker(&mutex);
+    return hits;
+}
+
+quint64 GlyphCache::getMisses()
+{
+    QMutexLocker locker(&mutex);
+    return misses;
+}
+
+int GlyphCache::getResidentBytes()
+{
+    QMutexLocker locker(&mutex);
+    return atlas.getResidentBytes();
+}
+
+QImage GlyphCache::getAtlasImage(FT_Pixel_Mode pixelMode)
+{
+    QMutexLocker locker(&mutex);
+    return atlas.getDebugImage(pixelMode);
+}
+
+/*************/
+/* GlyphData */
+/*************/
+
+GlyphData::GlyphData(const ShapedGlyph& glyphPos, const QSharedPointer<const GlyphBitmap>& bitmap)
+    : offsetX(static_cast<float>(glyphPos.offsetX) / PIXEL_FRACTION_FACTOR)
+    , offsetY(static_cast<float>(glyphPos.offsetY) / PIXEL_FRACTION_FACTOR)
+    , advanceX(static_cast<float>(glyphPos.advanceX) / PIXEL_FRACTION_FACTOR)
+    , advanceY(static_cast<float>(glyphPos.advanceY) / PIXEL_FRACTION_FACTOR)
+    , bitmap(bitmap)
+{
+}
+
 float GlyphData::getOffsetX() const
 {
     return offsetX;
@@ -411,12 +897,12 @@ float GlyphData::getOffsetY() const
 
 float GlyphData::getBearingLeft() const
 {
-    return bearingLeft;
+    return bitmap->getBearingLeft();
 }
 
 float GlyphData::getBearingTop() const
 {
-    return bearingTop;
+    return bitmap->getBearingTop();
 }
 
 float GlyphData::getAdvanceX() const
@@ -431,23 +917,17 @@ float GlyphData::getAdvanceY() const
 
 unsigned int GlyphData::getWidth() const
 {
-    if (pixelData == nullptr)
-        return 0;
-    return pixelData->getWidth();
+    return bitmap->getWidth();
 }
 
 unsigned int GlyphData::getHeight() const
 {
-    if (pixelData == nullptr)
-        return 0;
-    return pixelData->getHeight();
+    return bitmap->getHeight();
 }
 
-void GlyphData::paint(QImage* canvas, int x, int y, const QColor& pen)
+void GlyphData::paint(const GlyphPainter& painter, int x, int y)
 {
-    if (pixelData == nullptr)
-        return;
-    pixelData->paint(canvas, x, y, pen);
+    bitmap->paint(painter, x, y);
 }
 
 /***************/
@@ -468,53 +948,116 @@ FontShaping::FontShaping(FreeTypeLibrary* freetypeLib,
                          const char* text,
                          const char* font,
                          double pointSize,
-                         KXftConfig options)
+                         KXftConfig options,
+                         const QVector<hb_feature_t>& features,
+                         const CancellationToken* token)
 {
-    auto harfbuzzBuffer = hb_buffer_create();
-
-    //  we don't want to compute the length of an Unicode string
-    // -1 delegates length recognition to harfbuzz
-    hb_buffer_add_utf8(harfbuzzBuffer, text, -1, 0, -1);
-    hb_buffer_guess_segment_properties(harfbuzzBuffer);
-
-    path = fontManagement->retrievePath(font);
-    auto fontFace = freetypeLib->getFontFace(path);
+    TRACE_SCOPE("FontShaping");
+    glyphCount = 0;
+    glyphs = nullptr;
+    baseLineOffset = 0;
 
+    if (CancellationToken::abandon(token, RenderStage::Resolve)) {
+        return;
+    }
+    {
+        TRACE_SCOPE("resolve");
+        fontFile = fontManagement->retrievePath(font);
+    }
     auto ftSize = FreeTypeLibrary::convertPointSize(pointSize);
-    FT_Set_Char_Size(fontFace, 0, ftSize, 96, 96);
-    // TODO DPI
+    CharSize charSize(ftSize, options.dpiH, options.dpiV);
+    FT_Face fontFace;
+    {
+        TRACE_SCOPE("face");
+        fontFace = freetypeLib->getFontFace(*fontFile, charSize);
+    }
+    if (fontFace == nullptr) {
+        return;
+    }
 
     auto parameters = FreeTypeParameters(options);
     auto loadFlags = parameters.loadFlags;
     auto renderMode = parameters.renderMode;
 
-    auto hbFont = hb_ft_font_create(fontFace, nullptr);
-
     bool is_hinted = options.hintstyleSetting != KXftConfig::Hint::None;
-    hb_font_set_ppem(hbFont, is_hinted ? fontFace->size->metrics.x_ppem : 0,
-                     is_hinted ? fontFace->size->metrics.y_ppem : 0);
+    uint ppemX = is_hinted ? fontFace->size->metrics.x_ppem : 0;
+    uint ppemY = is_hinted ? fontFace->size->metrics.y_ppem : 0;
+
+    QByteArray featureString;
+    for (const auto& feature : features) {
+        char buffer[128];
+        hb_feature_to_string(const_cast<hb_feature_t*>(&feature), buffer, sizeof(buffer));
+        featureString.append(buffer).append(',');
+    }
 
-    hb_shape(hbFont, harfbuzzBuffer, nullptr, 0);
+    ShapedRunKey key(text, *fontFile, charSize, ppemX, ppemY, featureString);
+    QVector<ShapedGlyph> shapedRun;
+    if (CancellationToken::abandon(token, RenderStage::Shape)) {
+        return;
+    }
+    if (!ShapedRunCache::instance().find(key, &shapedRun)) {
+        TRACE_SCOPE("shape");
+        auto harfbuzzBuffer = freetypeLib->acquireBuffer();
+
+        //  we don't want to compute the length of an Unicode string
+        // -1 delegates length recognition to harfbuzz
+        hb_buffer_add_utf8(harfbuzzBuffer, text, -1, 0, -1);
+        hb_buffer_guess_segment_properties(harfbuzzBuffer);
+
+        auto hbFont = freetypeLib->getHarfbuzzFont(fontFace);
+        hb_font_set_ppem(hbFont, ppemX, ppemY);
+
+        // shape plans are cached by Harfbuzz per face, segment properties and features
+        hb_segment_properties_t segmentProperties;
+        hb_buffer_get_segment_properties(harfbuzzBuffer, &segmentProperties);
+        auto featureCount = static_cast<unsigned int>(features.size());
+        auto shapePlan = hb_shape_plan_create_cached(hb_font_get_face(hbFont), &segmentProperties,
+                                                     features.constData(), featureCount, nullptr);
+        hb_shape_plan_execute(shapePlan, hbFont, harfbuzzBuffer, features.constData(),
+                              featureCount);
+        hb_shape_plan_destroy(shapePlan);
+
+        unsigned int shapedCount = 0;
+        hb_glyph_info_t* glyphInfo = hb_buffer_get_glyph_infos(harfbuzzBuffer, &shapedCount);
+        hb_glyph_position_t* glyphPos = hb_buffer_get_glyph_positions(harfbuzzBuffer, &shapedCount);
+
+        shapedRun.resize(static_cast<int>(shapedCount));
+        for (unsigned int i = 0; i < shapedCount; ++i) {
+            shapedRun[i] = ShapedGlyph{ glyphInfo[i].codepoint, glyphPos[i].x_advance,
+                                        glyphPos[i].y_advance, glyphPos[i].x_offset,
+                                        glyphPos[i].y_offset };
+        }
 
-    glyphCount = 0;
-    hb_glyph_info_t* glyphInfo = hb_buffer_get_glyph_infos(harfbuzzBuffer, &glyphCount);
-    hb_glyph_position_t* glyphPos = hb_buffer_get_glyph_positions(harfbuzzBuffer, &glyphCount);
+        freetypeLib->releaseBuffer(harfbuzzBuffer);
+        ShapedRunCache::instance().insert(key, shapedRun);
+    }
 
+    if (CancellationToken::abandon(token, RenderStage::Raster)) {
+        return;
+    }
+    TRACE_SCOPE("raster");
+    glyphCount = static_cast<unsigned int>(shapedRun.size());
     glyphs = new GlyphData*[glyphCount];
+    bool reversedSubpixel = _subpixel_reverse(options);
 
     // assume we have horizontal writing
-    baseLineOffset = 0;
     float bottomExtend = 0;
 
     float width = 0;
 
     for (unsigned int i = 0; i < glyphCount; ++i) {
-        unsigned int glyphIndex = glyphInfo[i].codepoint;
-        FT_Load_Glyph(fontFace, glyphIndex, loadFlags);
-        auto glyphData = fontFace->glyph;
-        FT_Render_Glyph(glyphData, renderMode);
+        GlyphKey glyphKey(*fontFile, charSize, shapedRun[i].glyphIndex, loadFlags, renderMode,
+                          reversedSubpixel);
+        auto bitmap = GlyphCache::instance().find(glyphKey);
+        if (bitmap.isNull()) {
+            FT_Load_Glyph(fontFace, shapedRun[i].glyphIndex, loadFlags);
+            auto glyphData = fontFace->glyph;
+            FT_Render_Glyph(glyphData, renderMode);
+
+            bitmap = GlyphCache::instance().insert(glyphKey, glyphData, reversedSubpixel);
+        }
 
-        glyphs[i] = new GlyphData(&glyphPos[i], glyphData, _subpixel_reverse(options));
+        glyphs[i] = new GlyphData(shapedRun[i], bitmap);
 
         auto bearingTop = glyphs[i]->getBearingTop();
         if (bearingTop >= 0) {
@@ -536,11 +1079,6 @@ FontShaping::FontShaping(FreeTypeLibrary* freetypeLib,
         width += glyphs[glyphCount - 1]->getWidth();
     }
     boundingBox = QRectF(0, 0, width, baseLineOffset + bottomExtend);
-
-    // tidy up
-    hb_font_destroy(hbFont);
-    hb_buffer_destroy(harfbuzzBuffer);
-    FT_Done_Face(fontFace);
 }
 
 FontShaping::~FontShaping()
@@ -571,6 +1109,100 @@ QRectF FontShaping::getBoundingBox() const
     return boundingBox;
 }
 
+QSize FontShaping::getCanvasSize() const
+{
+    return QSize(ceill(boundingBox.width()), ceill(boundingBox.height()));
+}
+
+/*******************/
+/* CoverageMaskKey */
+/*******************/
+
+CoverageMaskKey::CoverageMaskKey(const QByteArray& text,
+                                 const FontFile& fontFile,
+                                 const CharSize& size,
+                                 int loadFlags,
+                                 FT_Render_Mode renderMode,
+                                 bool reversedSubpixel,
+                                 bool hinted)
+    : text(text)
+    , path(fontFile.path)
+    , faceIndex(fontFile.faceIndex)
+    , size(size)
+    , loadFlags(loadFlags)
+    , renderMode(renderMode)
+    , reversedSubpixel(reversedSubpixel)
+    , hinted(hinted)
+{
+}
+
+bool CoverageMaskKey::operator==(const CoverageMaskKey& other) const
+{
+    return text == other.text && faceIndex == other.faceIndex && size == other.size
+           && loadFlags == other.loadFlags && renderMode == other.renderMode
+           && reversedSubpixel == other.reversedSubpixel && hinted == other.hinted
+           && path == other.path;
+}
+
+uint qHash(const CoverageMaskKey& key, uint seed)
+{
+    uint mode = static_cast<uint>(key.renderMode) << 2 | (key.hinted ? 2 : 0)
+                | (key.reversedSubpixel ? 1 : 0);
+    return qHash(key.text, seed) ^ qHash(key.path, seed) * 31 ^ qHash(key.size, seed) * 37
+           ^ qHash(key.faceIndex ^ mode << 24, seed) ^ qHash(key.loadFlags, seed) * 41;
+}
+
+/*********************/
+/* CoverageMaskCache */
+/*********************/
+
+CoverageMaskCache::CoverageMaskCache(int maxBytes) : cache(maxBytes), hits(0), misses(0)
+{
+}
+
+CoverageMaskCache& CoverageMaskCache::instance()
+{
+    static CoverageMaskCache sharedCache;
+    return sharedCache;
+}
+
+QImage CoverageMaskCache::find(const CoverageMaskKey& key)
+{
+    QMutexLocker locker(&mutex);
+    auto cached = cache.object(key);
+    if (cached == nullptr) {
+        ++misses;
+        return QImage();
+    }
+    ++hits;
+    return *cached;
+}
+
+void CoverageMaskCache::insert(const CoverageMaskKey& key, const QImage& mask)
+{
+    QMutexLocker locker(&mutex);
+    // the cost of an empty mask must not be zero, otherwise they would pile up
+    cache.insert(key, new QImage(mask), qMax(1, static_cast<int>(mask.sizeInBytes())));
+}
+
+quint64 CoverageMaskCache::getHits()
+{
+    QMutexLocker locker(&mutex);
+    return hits;
+}
+
+quint64 CoverageMaskCache::getMisses()
+{
+    QMutexLocker locker(&mutex);
+    return misses;
+}
+
+int CoverageMaskCache::getResidentBytes()
+{
+    QMutexLocker locker(&mutex);
+    return cache.totalCost();
+}
+
 /*******************************/
 /* FreeTypeFontPreviewRenderer */
 /*******************************/
@@ -580,39 +1212,104 @@ QImage FreeTypeFontPreviewRenderer ::renderText(const char* text,
                                                 double pointSize,
                                                 KXftConfig options,
                                                 QColor background,
-                                                QColor pen)
+                                                QColor pen,
+                                                const CancellationToken* token)
 {
-    FontShaping fontShaping(freeTypeLibrary, fontManagement, text, font, pointSize, options);
-
-    auto width = fontShaping.getBoundingBox().width();
-    auto height = fontShaping.getBoundingBox().height();
+    TRACE_SCOPE("renderText");
+    auto fontShaping = layoutText(text, font, pointSize, options, token);
+    if (token != nullptr && token->isObsolete()) {
+        return QImage();
+    }
 
-    QImage canvas(ceill(width), ceill(height), QImage::Format_RGB888);
+    TRACE_SCOPE("paint");
+    QImage canvas(fontShaping->getCanvasSize(), QImage::Format_RGB32);
     canvas.fill(background);
 
-    float x = 0;
-    float y = 0;
+    // paint functions are selected once for the whole run
+    paintText(*fontShaping, GlyphPainter(&canvas, pen), 0, 0);
+
+    return canvas;
+}
+
+QSharedPointer<FontShaping> FreeTypeFontPreviewRenderer::layoutText(const char* text,
+                                                                    const char* font,
+                                                                    double pointSize,
+                                                                    KXftConfig options,
+                                                                    const CancellationToken* token)
+{
+    return QSharedPointer<FontShaping>::create(&FreeTypeLibrary::forCurrentThread(),
+                                               &FontManagement::instance(), text, font, pointSize,
+                                               options, QVector<hb_feature_t>(), token);
+}
+
+void FreeTypeFontPreviewRenderer::paintText(const FontShaping& text,
+                                            const GlyphPainter& painter,
+                                            int x,
+                                            int y)
+{
+    float advance = x;
+    for (unsigned int i = 0; i < text.getGlyphCount(); ++i) {
+        GlyphData* data = text.getGlyphs()[i];
+        auto offset = text.getBaseLineOffset() - data->getBearingTop() + data->getOffsetY();
 
-    for (unsigned int i = 0; i < fontShaping.getGlyphCount(); ++i) {
-        GlyphData* data = fontShaping.getGlyphs()[i];
-        auto offset = fontShaping.getBaseLineOffset() - data->getBearingTop() + data->getOffsetY();
+        data->paint(painter, rint(advance + data->getBearingLeft()), y + rint(offset));
 
-        data->paint(&canvas, rint(x + data->getBearingLeft()), rint(offset), pen);
+        advance += data->getAdvanceX();
+    }
+}
 
-        x += data->getAdvanceX();
+QImage FreeTypeFontPreviewRenderer::renderMask(const char* text,
+                                               const char* font,
+                                               double pointSize,
+                                               KXftConfig options,
+                                               const CancellationToken* token)
+{
+    TRACE_SCOPE("renderMask");
+    FreeTypeParameters parameters(options);
+    CharSize charSize(FreeTypeLibrary::convertPointSize(pointSize), options.dpiH, options.dpiV);
+    auto fontFile = FontManagement::instance().retrievePath(font);
+    // FontShaping shapes hinted texts for the ppem of the face, see ShapedRunKey
+    bool hinted = options.hintstyleSetting != KXftConfig::Hint::None;
+    CoverageMaskKey key(text, *fontFile, charSize, parameters.loadFlags, parameters.renderMode,
+                        _subpixel_reverse(options), hinted);
+    auto mask = CoverageMaskCache::instance().find(key);
+    if (!mask.isNull()) {
+        return mask;
     }
 
-    return canvas;
+    auto fontShaping = layoutText(text, font, pointSize, options, token);
+    if (token != nullptr && token->isObsolete()) {
+        return QImage();
+    }
+
+    TRACE_SCOPE("paint");
+    bool subpixel = parameters.renderMode == FT_RENDER_MODE_LCD
+                    || parameters.renderMode == FT_RENDER_MODE_LCD_V;
+    mask = QImage(fontShaping->getCanvasSize(),
+                  subpixel ? QImage::Format_RGB888 : QImage::Format_Grayscale8);
+    mask.fill(0);
+
+    // painting white on black yields the coverage
+    paintText(*fontShaping, GlyphPainter(&mask, Qt::white), 0, 0);
+
+    CoverageMaskCache::instance().insert(key, mask);
+    return mask;
 }
 
-FreeTypeFontPreviewRenderer::FreeTypeFontPreviewRenderer()
+void FreeTypeFontPreviewRenderer::paintMask(const QImage& mask,
+                                            const GlyphPainter& painter,
+                                            int x,
+                                            int y)
 {
-    freeTypeLibrary = new FreeTypeLibrary();
-    fontManagement = new FontManagement();
+    GlyphRaster raster{ mask.constBits(), mask.bytesPerLine(), mask.width(), mask.height() };
+    bool subpixel = mask.format() == QImage::Format_RGB888;
+    painter.paint(subpixel ? GlyphLayout::Rgb : GlyphLayout::GrayScale, raster, x, y);
 }
 
-FreeTypeFontPreviewRenderer::~FreeTypeFontPreviewRenderer()
+QImage FreeTypeFontPreviewRenderer::tintMask(const QImage& mask, QColor background, QColor pen)
 {
-    delete fontManagement;
-    delete freeTypeLibrary;
+    QImage canvas(mask.size(), QImage::Format_RGB32);
+    canvas.fill(background);
+    paintMask(mask, GlyphPainter(&canvas, pen), 0, 0);
+    return canvas;
 }
@@ -18,7 +18,10 @@
 #ifndef FREETYPE_RENDERER_H
 #define FREETYPE_RENDERER_H
 
+#include "cancellation.h"
+#include "glyphatlas.h"
 #include "kxftconfig.h"
+#include "paintkernels.h"
 
 extern "C" {
 #include <ft2build.h>
@@ -29,9 +32,44 @@ extern "C" {
 
 #include <QBitArray>
 #include <QByteArray>
+#include <QCache>
 #include <QColor>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QImage>
+#include <QList>
+#include <QMutex>
 #include <QRectF>
+#include <QSharedPointer>
+#include <QSize>
+#include <QVector>
+
+/**
+ * @brief The FontFile class identifies a font face on disk.
+ *
+ * Font files may be collections (e.g. TrueType collections), hence the path alone is not
+ * sufficient to address a face. Instances are immutable and meant to be shared.
+ */
+class FontFile
+{
+public:
+    FontFile(const QByteArray& path, int faceIndex = 0);
+
+    /**
+     * @brief path of the font file, empty if the font could not be resolved.
+     */
+    const QByteArray path;
+
+    /**
+     * @brief faceIndex is the index of the face within the font file.
+     */
+    const int faceIndex;
+
+    /**
+     * @return true if the font was resolved to a file
+     */
+    bool isValid() const;
+};
 
 /**
  * @brief The FontManagement class is a wrapper around the Fontconfig library.
@@ -39,6 +77,8 @@ extern "C" {
  * Fontconfig is commonly used to manage font files on the system and has a complex configuration
  * system. In particular it handles font substitution. It therefore can provide a font file for a
  * given font specification, which is used in the retrievePath method.
+ *
+ * All methods are thread safe, so render threads can share one instance, see @ref instance.
  */
 class FontManagement
 {
@@ -53,6 +93,11 @@ public:
     FontManagement& operator=(const FontManagement&) = delete;
     FontManagement(const FontManagement&) = delete;
 
+    /**
+     * @return the process wide instance shared by all render threads
+     */
+    static FontManagement& instance();
+
     /**
      * @brief retrievePath fetches the path of a specified font.
      *
@@ -61,20 +106,57 @@ public:
      * path is copied from the Fontconfig data structures which are destroyed after this method
      * call.
      *
+     * Results are memoized by the normalized pattern string, so equivalent font names share one
+     * resolution. The cache is dropped as soon as Fontconfig reports a configuration change.
+     *
      * @param font name to specify the font
-     * @return path to the font file
+     * @return path and face index of the font file, which is invalid if nothing matched
      */
-    const char* retrievePath(const char* font);
+    QSharedPointer<const FontFile> retrievePath(const char* font);
 
     /**
-     * @brief copyFcString helper method to retrieve the font path from Fontconfig data structures
-     * @param fcString pointer to the path in the data structure
-     * @return string copy of the path
+     * @return number of retrievePath calls answered from the resolution cache
      */
-    static inline const char* copyFcString(const FcChar8* fcString);
+    quint64 getCacheHits() const;
+
+    /**
+     * @return number of retrievePath calls, which needed a Fontconfig match
+     */
+    quint64 getCacheMisses() const;
+
+    /**
+     * @brief clear drops the memoized resolutions, e.g. to measure uncached renderings.
+     */
+    void clear();
 
 private:
+    mutable QMutex mutex;
     FcConfig* fontConfig;
+
+    /**
+     * @brief resolutionCache maps normalized Fontconfig patterns to resolved font files.
+     */
+    QHash<QByteArray, QSharedPointer<const FontFile>> resolutionCache;
+    quint64 cacheHits;
+    quint64 cacheMisses;
+
+    /**
+     * @brief lastUptoDateCheck throttles checking the Fontconfig configuration for changes.
+     */
+    QElapsedTimer lastUptoDateCheck;
+
+    /**
+     * @brief invalidateIfOutdated reloads the configuration and drops all cached resolutions, if
+     * Fontconfig reports changed configuration or font directories.
+     */
+    void invalidateIfOutdated();
+
+    /**
+     * @brief resolve conducts the actual font substitution for a parsed pattern.
+     * @param pattern Fontconfig pattern, which will be modified by substitution
+     * @return resolved font file
+     */
+    QSharedPointer<const FontFile> resolve(FcPattern* pattern);
 };
 
 /**
@@ -95,26 +177,270 @@ public:
 };
 
 /**
- * @brief The FreeTypeLibrary class
+ * @brief The CharSize class describes the scaling of a font face as passed to FT_Set_Char_Size.
+ */
+class CharSize
+{
+public:
+    CharSize(long charSize, uint dpiH, uint dpiV);
+
+    /**
+     * @brief charSize in 1/64 of typographic points, see @ref FreeTypeLibrary::convertPointSize
+     */
+    long charSize;
+    uint dpiH;
+    uint dpiV;
+
+    bool operator==(const CharSize& other) const;
+};
+
+uint qHash(const CharSize& key, uint seed = 0);
+
+/**
+ * @brief The FreeTypeLibrary class wraps a FreeType library instance together with its faces.
+ *
+ * Opening a face means parsing the font file, which is too expensive to be done for every string
+ * rendered. Therefore faces are kept open in a bounded cache with least recently used eviction.
+ * For every face the scaled size objects (FT_Size) are cached as well, so switching between
+ * sizes is just an activation of the respective size object.
+ *
+ * The Harfbuzz fonts are attached to the size objects and share their life time, which allows
+ * Harfbuzz to keep its lookup acceleration structures and shape plans across shaping runs. Also
+ * Harfbuzz buffers are pooled in order to reuse their allocations.
+ *
+ * FreeType faces must not be used from several threads at once, hence a library instance is not
+ * thread safe. Render threads use their own instance, see @ref forCurrentThread.
  */
 class FreeTypeLibrary
 {
 private:
+    /**
+     * @brief The CachedSize struct holds a size object of a cached face.
+     */
+    struct CachedSize
+    {
+        CharSize charSize;
+        FT_Size size;
+    };
+
+    /**
+     * @brief The CachedFace struct holds an open face and its size objects, where the most
+     * recently used size is kept at the front.
+     *
+     * The Harfbuzz face is shared by the fonts of all sizes, so the layout tables are parsed and
+     * the shape plans are cached once per face. It is created on first use.
+     */
+    struct CachedFace
+    {
+        QByteArray path;
+        int faceIndex;
+        FT_Face face;
+        QList<CachedSize> sizes;
+        hb_face_t* harfbuzzFace;
+    };
+
     FT_Library freetypeLib;
 
+    /**
+     * @brief faces are the currently open faces, the most recently used at the front.
+     */
+    QList<CachedFace*> faces;
+
+    const int maxFaces;
+    const int maxSizesPerFace;
+
+    quint64 faceRequests;
+    quint64 faceReuses;
+
+    /**
+     * @brief bufferPool holds Harfbuzz buffers, which are currently not in use.
+     */
+    QList<hb_buffer_t*> bufferPool;
+
+    void closeFace(CachedFace* cachedFace);
+
+    /**
+     * @brief destroyHarfbuzzFont is the finalizer for Harfbuzz fonts attached to a FT_Size.
+     * @param object the size object, which is going to be destroyed
+     */
+    static void destroyHarfbuzzFont(void* object);
+
 public:
-    FreeTypeLibrary();
+    /**
+     * @brief FreeTypeLibrary constructor initializes the FreeType library.
+     * @param maxFaces number of faces kept open at most
+     * @param maxSizesPerFace number of size objects kept per face at most
+     */
+    explicit FreeTypeLibrary(int maxFaces = 16, int maxSizesPerFace = 8);
     virtual ~FreeTypeLibrary();
 
-    FT_Face getFontFace(const char* path);
+    FreeTypeLibrary& operator=(const FreeTypeLibrary&) = delete;
+    FreeTypeLibrary(const FreeTypeLibrary&) = delete;
+
+    /**
+     * @brief forCurrentThread provides the library instance of the calling thread.
+     *
+     * The instance is created on first use and destroyed when the thread finishes, so worker
+     * threads of a thread pool keep their open faces across tasks.
+     */
+    static FreeTypeLibrary& forCurrentThread();
+
+    /**
+     * @brief getFontFace provides a face scaled to the given size.
+     *
+     * The face is owned by the library and stays valid until it gets evicted by subsequent calls
+     * of this method. Callers must not call FT_Done_Face or FT_Set_Char_Size on it.
+     * @param fontFile the face to open
+     * @param size scaling of the face, which will be the active size of the returned face
+     * @return the face or nullptr, if it could not be opened
+     */
+    FT_Face getFontFace(const FontFile& fontFile, const CharSize& size);
+
+    /**
+     * @brief getHarfbuzzFont provides the Harfbuzz font for the active size of a face.
+     *
+     * The font is created on first use from the Harfbuzz face shared by all sizes and scaled to
+     * the active size. It is destroyed together with the size object, therefore the caller must
+     * not destroy it.
+     * @param face a face obtained from @ref getFontFace, which is still open
+     * @return Harfbuzz font for the active size or nullptr, if the face is not open
+     */
+    hb_font_t* getHarfbuzzFont(FT_Face face);
 
     /**
-     * This inline function converts point size from float to internal integer representation used
+     * @brief acquireBuffer provides an empty Harfbuzz buffer, which should be given back by
+     * @ref releaseBuffer.
+     */
+    hb_buffer_t* acquireBuffer();
+
+    /**
+     * @brief releaseBuffer gives back a buffer to the pool. The contents are dropped, but the
+     * allocated memory is kept for the next use.
+     */
+    void releaseBuffer(hb_buffer_t* buffer);
+
+    /**
+     * @brief closeFaces closes all open faces, which invalidates all faces returned so far.
+     */
+    void closeFaces();
+
+    /**
+     * @return number of faces currently open
+     */
+    int getOpenFaceCount() const;
+
+    /**
+     * @return number of getFontFace calls
+     */
+    quint64 getFaceRequests() const;
+
+    /**
+     * @return number of getFontFace calls, which were served by an already open face
+     */
+    quint64 getFaceReuses() const;
+
+    /**
+     * @return ratio of getFontFace calls, which were served by an already open face
+     */
+    double getReuseRatio() const;
+
+    /**
+     * This function converts point size from float to internal integer representation used
      * by FreeType. Keep in mind that point size isn't a discrete measure and therefore a float.
      * @param pointSize size in typographic units
      * @return internal integer representation used by FreeType
      */
-    static inline long convertPointSize(double pointSize);
+    static long convertPointSize(double pointSize);
+};
+
+/**
+ * @brief The ShapedGlyph struct holds the result of a shaping run for a single glyph.
+ *
+ * Positions are given in FreeType's 26.6 fixed point format, i.e. 1/64 of a pixel.
+ */
+struct ShapedGlyph
+{
+    quint32 glyphIndex;
+    qint32 advanceX;
+    qint32 advanceY;
+    qint32 offsetX;
+    qint32 offsetY;
+};
+
+Q_DECLARE_TYPEINFO(ShapedGlyph, Q_PRIMITIVE_TYPE);
+
+/**
+ * @brief The ShapedRunKey class identifies the input of a shaping run.
+ *
+ * Shaping only depends on the text, the face, its scaling and the features. The pixels per em are
+ * only passed to Harfbuzz for hinted rendering, otherwise they are set to zero.
+ */
+class ShapedRunKey
+{
+public:
+    ShapedRunKey(const QByteArray& text,
+                 const FontFile& fontFile,
+                 const CharSize& size,
+                 uint ppemX,
+                 uint ppemY,
+                 const QByteArray& features);
+
+    QByteArray text;
+    QByteArray path;
+    int faceIndex;
+    CharSize size;
+    uint ppemX;
+    uint ppemY;
+    QByteArray features;
+
+    bool operator==(const ShapedRunKey& other) const;
+};
+
+uint qHash(const ShapedRunKey& key, uint seed = 0);
+
+/**
+ * @brief The ShapedRunCache class keeps results of shaping runs across rendering variants.
+ *
+ * Rendering variants, which only differ in anti-aliasing or sub-pixel order, share the same
+ * shaping result. The cache is shared by all renderers of the process and can be used from
+ * several threads.
+ */
+class ShapedRunCache
+{
+private:
+    QMutex mutex;
+    QCache<ShapedRunKey, QVector<ShapedGlyph>> cache;
+    quint64 hits;
+    quint64 misses;
+
+public:
+    /**
+     * @param maxGlyphs number of glyphs kept at most over all cached runs
+     */
+    explicit ShapedRunCache(int maxGlyphs = 65536);
+
+    /**
+     * @return the cache shared by all renderers
+     */
+    static ShapedRunCache& instance();
+
+    /**
+     * @brief find looks up a shaping result.
+     * @param key input of the shaping run
+     * @param run receives the cached result, which is implicitly shared
+     * @return true if there was a cached result
+     */
+    bool find(const ShapedRunKey& key, QVector<ShapedGlyph>* run);
+
+    void insert(const ShapedRunKey& key, const QVector<ShapedGlyph>& run);
+
+    /**
+     * @brief clear drops all shaping results, the statistics are kept.
+     */
+    void clear();
+
+    quint64 getHits();
+    quint64 getMisses();
 };
 
 /**
@@ -124,6 +450,10 @@ public:
  * data provided by FreeType. Depending on the parameters for font rendering FreeType uses different
  * approached for storing the data, e.g. if anti-aliasing is turned off, glyphs are rendered in
  * monochrome (handles by subclass MonochromeGlyph) using only one bit per pixel.
+ *
+ * Rastered glyphs do not own their data, they are light weight views on glyph data stored
+ * elsewhere, usually in a @ref GlyphAtlas. Painting is delegated to a @ref GlyphPainter, the
+ * classes only describe the layout of the data.
  */
 class RasteredGlyph
 {
@@ -133,9 +463,10 @@ protected:
      * @brief pitch is the length of one row of glyph data in bytes and signedness encoding
      * direction.
      *
-     * The pitch is copied from the FreeType glyph data structure. It can be positive or negative
+     * The pitch is copied from the FreeType bitmap structure. It can be positive or negative
      * depending on the direction, in which the glyph is renders. See also FT_Bitmap in the FreeType
-     * documentation. An always positive length value is stored in rowLength.
+     * documentation. An always positive length value is stored in rowLength. For glyphs stored in
+     * an atlas this is the width of the atlas page.
      */
     const int pitch;
 
@@ -157,6 +488,12 @@ protected:
      */
     const unsigned int height;
 
+    /**
+     * @brief raster describes the glyph data for a @ref GlyphPainter.
+     * @param buffer first byte of the glyph data
+     */
+    GlyphRaster raster(const unsigned char* buffer) const;
+
 public:
     /**
      * @brief RasteredGlyph constructor
@@ -164,7 +501,7 @@ public:
      * The bitmap data structure has also a width and height (rows) field, however for sub-pixel
      * rendered bitmaps the respective value will be in sub-pixels, i.e. three times larger. This
      * should be handled by the constructor of the specialized sub-class.
-     * @param bitmap the rendering result from FreeType
+     * @param bitmap describes the glyph data, which has to outlive the rastered glyph
      * @param width the actual width in pixels
      * @param height the actual height in pixels
      */
@@ -184,7 +521,7 @@ public:
      * @param y upmost coordinate where to start painting the glyph.
      * @param pen color, in which the glyph will be painted.
      */
-    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) = 0;
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const = 0;
 
     /**
      * @return the pixel height.
@@ -207,9 +544,9 @@ class MonochromeGlyph : public RasteredGlyph
 {
 protected:
     /**
-     * @brief bitmap holds the pixel data of a rendered glyph, where every bit denotes a pixel.
+     * @brief bitmap points to the pixel data of a rendered glyph, where every bit denotes a pixel.
      */
-    unsigned char* bitmap;
+    const unsigned char* bitmap;
 
 public:
     /**
@@ -218,35 +555,17 @@ public:
      * The width and height are passed from the FT_Bitmap input to the base constructor (@ref
      * RasteredGlyph::RasteredGlyph). Side note: the width field in FT_Bitmap for monochrome glyph
      * data gives the width in pixels (in contrast sub-pixel rendered glyph data).
-     * @param bitmap the rendering result from FreeType
+     * @param bitmap see @ref RasteredGlyph::RasteredGlyph
      */
     MonochromeGlyph(FT_Bitmap* bitmap);
 
-    /**
-     * @brief ~MonochromeGlyph frees private bitmap data copied from FreeType bitmap.
-     */
-    virtual ~MonochromeGlyph();
-
     /**
      * @copydoc RasteredGlyph::paint
      *
      * This will paint the monochrome glyph to the canvas. Since there is no anti-aliasing involved
      * no alpha blending is needed.
      */
-    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) override;
-
-    /**
-     * @brief pixelAt is a helper function to access the bit data of a single pixel.
-     *
-     * This is necessary since not only one byte holds the data of eight pixels but also they are
-     * stored in most-significant bit order.
-     * @param x horizontal pixel position in the glyph bitmap
-     * @param y vertical pixel position in the glyph bitmap
-     * @param pitch see @ref RasteredGlyph::pitch
-     * @param buffer see @ref bitmap
-     * @return 1 if the pixel is covered by the glyph and 0 otherwise
-     */
-    inline int pixelAt(uint x, uint y, int pitch, const unsigned char* buffer);
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override;
 };
 
 /**
@@ -259,30 +578,23 @@ class ByteDataGlyph : public RasteredGlyph
 {
 protected:
     /**
-     * @brief bytemap stores the glyph data copied from the FreeType bitmap.
+     * @brief bytemap points to the glyph data, where one byte denotes a (sub-)pixel.
      */
-    QByteArray* bytemap;
+    const unsigned char* bytemap;
 
 public:
     /**
      * @brief ByteDataGlyph constructor.
      * @param bitmap see @ref RasteredGlyph::RasteredGlyph
-     * @param bytesPerPixel number of bytes used to store one pixel. For gray scale glyphs it would
-     *        be set to 1, for sub-pixel rendered glyphs it would be 3 (one for each sub-pixel).
      * @param width see @ref RasteredGlyph::RasteredGlyph
      * @param height see @ref RasteredGlyph::RasteredGlyph
      */
-    ByteDataGlyph(FT_Bitmap* bitmap, uint bytesPerPixel, uint width, uint height);
-
-    /**
-     * @brief ~ByteDataGlyph frees private byte array with data copied from FreeType bitmap.
-     */
-    virtual ~ByteDataGlyph();
+    ByteDataGlyph(FT_Bitmap* bitmap, uint width, uint height);
 
     /**
      * @copydoc RasteredGlyph::paint
      */
-    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) override = 0;
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override = 0;
 };
 
 /**
@@ -302,7 +614,7 @@ public:
      *
      * Pen color will be alpha blended onto the background.
      */
-    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) override;
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override;
 };
 
 /**
@@ -315,10 +627,8 @@ public:
  * display is used in a turned position, the orientation and order of the sub-pixels change and
  * glyphs have to be rendered and displayed differently.
  *
- * This class implements the common per sub-pixel alpha blending in the paint method. Since
- * horizontal and vertical sub-pixel rendered glyphs are stored differently by FreeType the access
- * is encapsulated in the sub-classes SubPixelGlyph and VerticalSubPixelGlyph, which implement the
- * getValue method.
+ * Since horizontal and vertical sub-pixel rendered glyphs are stored differently by FreeType the
+ * access is encapsulated in the sub-classes SubPixelGlyph and VerticalSubPixelGlyph.
  */
 class AbstractSubPixelGlyph : public ByteDataGlyph
 {
@@ -330,28 +640,15 @@ protected:
      */
     bool reverse;
 
-    /**
-     * @brief getValue retrieve the sub-pixel value of a pixel in the rendered glyph image.
-     * @param row in rendered glyph, y coordinate
-     * @param column in rendered glyph, x coordinate
-     * @param offset selector for sub-pixel is one out of 0, 1 or 2.
-     *        Depending on the orientation 0 selects the left or top sub-pixel, 1 selects the middle
-     *        sub-pixel and 2 selects the right or bottom sub-pixel.
-     * @return the area of the sub-pixel covered by the glyph in a range from 0 to 255, where 0 is
-     *         not covered and 255 is fully covered.
-     */
-    virtual unsigned char getValue(int row, int column, int offset) = 0;
-
 public:
-    AbstractSubPixelGlyph(
-        FT_Bitmap* bitmap, uint bytesPerPixel, uint width, uint height, bool reversed);
+    AbstractSubPixelGlyph(FT_Bitmap* bitmap, uint width, uint height, bool reversed);
 
     /**
      * @copydoc RasteredGlyph::paint
      *
      * Pen color will be alpha blended separately for every sub-pixel onto the background.
      */
-    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) override;
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override = 0;
 };
 
 /**
@@ -360,11 +657,13 @@ public:
  */
 class SubPixelGlyph : public AbstractSubPixelGlyph
 {
-protected:
-    virtual inline unsigned char getValue(int row, int, int offset) override;
-
 public:
     SubPixelGlyph(FT_Bitmap* bitmap, bool reversed);
+
+    /**
+     * @copydoc AbstractSubPixelGlyph::paint
+     */
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override;
 };
 
 /**
@@ -373,11 +672,173 @@ public:
  */
 class VerticalSubPixelGlyph : public AbstractSubPixelGlyph
 {
-protected:
-    virtual inline unsigned char getValue(int row, int column, int offset) override;
-
 public:
     VerticalSubPixelGlyph(FT_Bitmap* bitmap, bool reversed);
+
+    /**
+     * @copydoc AbstractSubPixelGlyph::paint
+     */
+    virtual void paint(QImage* canvas, int x, int y, const QColor& pen) const override;
+};
+
+/**
+ * @brief The GlyphKey class identifies the rasterization of a single glyph.
+ */
+class GlyphKey
+{
+public:
+    GlyphKey(const FontFile& fontFile,
+             const CharSize& size,
+             quint32 glyphIndex,
+             int loadFlags,
+             FT_Render_Mode renderMode,
+             bool reversedSubpixel);
+
+    QByteArray path;
+    int faceIndex;
+    CharSize size;
+    quint32 glyphIndex;
+    int loadFlags;
+    FT_Render_Mode renderMode;
+    bool reversedSubpixel;
+
+    bool operator==(const GlyphKey& other) const;
+};
+
+uint qHash(const GlyphKey& key, uint seed = 0);
+
+/**
+ * @brief The GlyphBitmap class holds the rasterization result of a glyph together with its
+ * bearings, i.e. everything which is independent from the position of the glyph in a text.
+ *
+ * The glyph data itself is stored in a region of a @ref GlyphAtlas page, hence the glyph only
+ * consists of the region and metrics.
+ */
+class GlyphBitmap
+{
+private:
+    const float bearingLeft;
+    const float bearingTop;
+    const unsigned char pixelMode;
+
+    /**
+     * @brief bitmapWidth and bitmapRows are the dimensions as given by FreeType, i.e. in
+     * sub-pixels for sub-pixel rendered glyphs.
+     */
+    const unsigned int bitmapWidth;
+    const unsigned int bitmapRows;
+
+    const AtlasRegion region;
+
+    /**
+     * @brief layout of the glyph data, only valid for supported pixel modes.
+     */
+    GlyphLayout layout;
+
+public:
+    /**
+     * @brief GlyphBitmap constructor copies the rendered glyph from the glyph slot into the atlas.
+     * @param glyphData is the data structure from FreeType containing the render results of a
+     *        glyph.
+     * @param reversedSubpixel This is only relevant for sub-pixel rendered glyphs. Set this to true
+     *        for bgr and vbgr sub-pixel order. See also @ref AbstractSubPixelGlyph::reverse.
+     * @param region reserved space in the atlas, see @ref requiredBytesPerRow. It may be null for
+     *        empty or unsupported glyphs.
+     */
+    GlyphBitmap(FT_GlyphSlotRec* glyphData, bool reversedSubpixel, const AtlasRegion& region);
+
+    GlyphBitmap& operator=(const GlyphBitmap&) = delete;
+    GlyphBitmap(const GlyphBitmap&) = delete;
+
+    /**
+     * @brief requiredBytesPerRow computes the space needed for one row of a rendered glyph.
+     * @param bitmap the rendering result from FreeType
+     * @return number of bytes or 0 for unsupported pixel modes
+     */
+    static int requiredBytesPerRow(const FT_Bitmap& bitmap);
+
+    float getBearingLeft() const;
+    float getBearingTop() const;
+    unsigned int getWidth() const;
+    unsigned int getHeight() const;
+
+    /**
+     * @return the atlas page holding the glyph data or nullptr for empty glyphs
+     */
+    AtlasPage* getPage() const;
+
+    /**
+     * @brief paint the glyph with its upper left corner at (x,y).
+     * @param painter selected once for all glyphs painted onto the same canvas
+     */
+    void paint(const GlyphPainter& painter, int x, int y) const;
+};
+
+/**
+ * @brief The GlyphCache class keeps rendered glyphs across texts and previews.
+ *
+ * The glyph data is packed into a @ref GlyphAtlas, which is bounded by a byte budget. Once it is
+ * exhausted, the least recently used atlas page is dropped together with all glyphs on it. Glyphs
+ * are handed out as shared pointers, hence evicting a page does not affect users of its glyphs.
+ * The cache is shared by all renderers of the process and can be used from several threads.
+ */
+class GlyphCache
+{
+private:
+    QMutex mutex;
+    GlyphAtlas atlas;
+    QHash<GlyphKey, QSharedPointer<const GlyphBitmap>> glyphs;
+    quint64 hits;
+    quint64 misses;
+
+    /**
+     * @brief allocate reserves atlas space and evicts pages as needed.
+     */
+    AtlasRegion allocate(const FT_Bitmap& bitmap);
+
+public:
+    /**
+     * @param maxBytes memory budget for cached glyph data
+     */
+    explicit GlyphCache(int maxBytes = 8 * 1024 * 1024);
+
+    /**
+     * @return the cache shared by all renderers
+     */
+    static GlyphCache& instance();
+
+    /**
+     * @return the cached glyph or a null pointer
+     */
+    QSharedPointer<const GlyphBitmap> find(const GlyphKey& key);
+
+    /**
+     * @brief insert copies a rendered glyph into the cache.
+     * @param key identifies the glyph
+     * @param glyphData the glyph slot holding the rendering result
+     * @param reversedSubpixel see @ref GlyphBitmap::GlyphBitmap
+     * @return the cached glyph
+     */
+    QSharedPointer<const GlyphBitmap>
+    insert(const GlyphKey& key, FT_GlyphSlotRec* glyphData, bool reversedSubpixel);
+
+    /**
+     * @brief clear drops all glyphs and atlas pages, the statistics are kept.
+     */
+    void clear();
+
+    quint64 getHits();
+    quint64 getMisses();
+
+    /**
+     * @return memory used by the atlas pages in bytes
+     */
+    int getResidentBytes();
+
+    /**
+     * @return the atlas pages of a pixel mode as image, see @ref GlyphAtlas::getDebugImage
+     */
+    QImage getAtlasImage(FT_Pixel_Mode pixelMode);
 };
 
 /**
@@ -392,23 +853,16 @@ private:
     const float offsetY;
     const float advanceX;
     const float advanceY;
-    const float bearingLeft;
-    const float bearingTop;
 
-    RasteredGlyph* pixelData;
+    QSharedPointer<const GlyphBitmap> bitmap;
 
 public:
     /**
      * @brief GlyphData constructor
-     * @param glyphPos is a Harfbuzz position data structure from a Harfbuzz font shaping run.
-     * @param glyphData is the data structure from FreeType containing the render results of a
-     *        glyph.
-     * @param reversedSubpixel This is only relevant for sub-pixel rendered glyphs. Set this to true
-     *        for bgr and vbgr sub-pixel order. See also @ref AbstractSubPixelGlyph::reverse.
+     * @param glyphPos is the position data of the glyph from a shaping run.
+     * @param bitmap is the rendered glyph, which might be shared with other texts.
      */
-    GlyphData(hb_glyph_position_t* glyphPos,
-              FT_GlyphSlotRec* glyphData,
-              bool reversedSubpixel = false);
+    GlyphData(const ShapedGlyph& glyphPos, const QSharedPointer<const GlyphBitmap>& bitmap);
     float getOffsetX() const;
     float getOffsetY() const;
     float getBearingLeft() const;
@@ -417,7 +871,7 @@ public:
     float getAdvanceY() const;
     unsigned int getWidth() const;
     unsigned int getHeight() const;
-    void paint(QImage* canvas, int x, int y, const QColor& pen);
+    void paint(const GlyphPainter& painter, int x, int y);
 };
 
 /**
@@ -429,7 +883,7 @@ public:
 class FontShaping
 {
 private:
-    const char* path;
+    QSharedPointer<const FontFile> fontFile;
 
     unsigned int glyphCount;
     GlyphData** glyphs;
@@ -445,13 +899,18 @@ public:
      * @param font see @ref FreeTypeFontPreviewRenderer::renderText
      * @param pointSize see @ref FreeTypeFontPreviewRenderer::renderText
      * @param options see @ref FreeTypeFontPreviewRenderer::renderText
+     * @param features OpenType features applied during shaping
+     * @param token is checked before resolving, shaping and rastering; an obsolete rendering
+     *        stops early and yields no glyphs
      */
     FontShaping(FreeTypeLibrary* freetypeLib,
                 FontManagement* fontManagement,
                 const char* text,
                 const char* font,
                 double pointSize,
-                KXftConfig options);
+                KXftConfig options,
+                const QVector<hb_feature_t>& features = QVector<hb_feature_t>(),
+                const CancellationToken* token = nullptr);
 
     ~FontShaping();
 
@@ -459,26 +918,99 @@ public:
     GlyphData** getGlyphs() const;
     unsigned int getBaseLineOffset() const;
     QRectF getBoundingBox() const;
+
+    /**
+     * @return size in pixels of a canvas, which takes the whole text
+     */
+    QSize getCanvasSize() const;
 };
 
 /**
- * The FreeTypeFontPreviewRenderer class provides the possibility to render Text with FreeType
- * offside.
+ * @brief The CoverageMaskKey class identifies a rendered text independent of its colors.
+ *
+ * The font is identified by the resolved font file and the rendering options by the FreeType
+ * parameters they result in, so equivalent settings share one mask. Whether the text is hinted
+ * is part of the key as well, since it changes the shaping, see @ref ShapedRunKey.
  */
-class FreeTypeFontPreviewRenderer
+class CoverageMaskKey
+{
+public:
+    CoverageMaskKey(const QByteArray& text,
+                    const FontFile& fontFile,
+                    const CharSize& size,
+                    int loadFlags,
+                    FT_Render_Mode renderMode,
+                    bool reversedSubpixel,
+                    bool hinted);
+
+    QByteArray text;
+    QByteArray path;
+    int faceIndex;
+    CharSize size;
+    int loadFlags;
+    FT_Render_Mode renderMode;
+    bool reversedSubpixel;
+    bool hinted;
+
+    bool operator==(const CoverageMaskKey& other) const;
+};
+
+uint qHash(const CoverageMaskKey& key, uint seed = 0);
+
+/**
+ * @brief The CoverageMaskCache class keeps coverage masks of rendered texts, see
+ * @ref FreeTypeFontPreviewRenderer::renderMask.
+ *
+ * Since masks carry no colors, a cached mask serves every color scheme. The cache is shared by
+ * all renderers of the process and can be used from several threads.
+ */
+class CoverageMaskCache
 {
 private:
-    FreeTypeLibrary* freeTypeLibrary;
-    FontManagement* fontManagement;
+    QMutex mutex;
+    QCache<CoverageMaskKey, QImage> cache;
+    quint64 hits;
+    quint64 misses;
 
 public:
     /**
-     * @brief FreeTypeFontPreviewRenderer
-     *
-     * The constructor initializes the library classes for Harfbuzz, FreeType and Fontconfig.
+     * @param maxBytes memory budget for the pixel data of all cached masks
      */
-    explicit FreeTypeFontPreviewRenderer();
-    virtual ~FreeTypeFontPreviewRenderer();
+    explicit CoverageMaskCache(int maxBytes = 8 * 1024 * 1024);
+
+    /**
+     * @return the cache shared by all renderers
+     */
+    static CoverageMaskCache& instance();
+
+    /**
+     * @return the cached mask, which is implicitly shared, or a null image
+     */
+    QImage find(const CoverageMaskKey& key);
+
+    void insert(const CoverageMaskKey& key, const QImage& mask);
+
+    quint64 getHits();
+    quint64 getMisses();
+
+    /**
+     * @return bytes of pixel data held by the cached masks
+     */
+    int getResidentBytes();
+};
+
+/**
+ * The FreeTypeFontPreviewRenderer class provides the possibility to render Text with FreeType
+ * offside.
+ *
+ * Rendering is thread safe: every thread uses its own @ref FreeTypeLibrary, while the font
+ * resolution and the caches for shaping results and glyphs are shared.
+ */
+class FreeTypeFontPreviewRenderer
+{
+public:
+    explicit FreeTypeFontPreviewRenderer() = default;
+    virtual ~FreeTypeFontPreviewRenderer() = default;
 
     /**
      * @brief Render text independent from render settings of the running session.
@@ -492,14 +1024,82 @@ public:
      * @param options config object which contains anti-aliasing, hinting and sub-pixel settings
      * @param background color
      * @param pen writing color
-     * @return rendered text as QImage
+     * @param token optional, see @ref FontShaping::FontShaping
+     * @return rendered text as QImage, which is null if the rendering became obsolete
      */
     QImage renderText(const char* text,
                       const char* font,
                       double pointSize,
                       KXftConfig options,
                       QColor background,
-                      QColor pen);
+                      QColor pen,
+                      const CancellationToken* token = nullptr);
+
+    /**
+     * @brief layoutText shapes and rasters the text without painting it.
+     *
+     * This is the first of two phases for composing several texts on one canvas: all texts are
+     * laid out, so the required space is known from the glyph metrics, before the canvas is
+     * allocated and the texts are painted with @ref paintText.
+     * @param text see @ref renderText
+     * @param font see @ref renderText
+     * @param pointSize see @ref renderText
+     * @param options see @ref renderText
+     * @param token optional, see @ref FontShaping::FontShaping
+     * @return the laid out text, which has no glyphs if the rendering became obsolete
+     */
+    QSharedPointer<FontShaping> layoutText(const char* text,
+                                           const char* font,
+                                           double pointSize,
+                                           KXftConfig options,
+                                           const CancellationToken* token = nullptr);
+
+    /**
+     * @brief paintText paints a laid out text directly onto a canvas.
+     * @param text laid out by @ref layoutText
+     * @param painter for the canvas and the pen color
+     * @param x left edge of the text on the canvas
+     * @param y top edge of the text on the canvas
+     */
+    static void paintText(const FontShaping& text, const GlyphPainter& painter, int x, int y);
+
+    /**
+     * @brief renderMask renders the coverage of the text instead of colored pixels.
+     *
+     * Colors are applied later by @ref paintMask or @ref tintMask, which is a cheap blend of the
+     * coverage. Hence one mask serves any background and pen color. Masks are kept in the
+     * @ref CoverageMaskCache.
+     *
+     * Sub-pixel rendered text yields a QImage::Format_RGB888 mask with the coverage of the red,
+     * green and blue sub-pixels, in that order regardless of the sub-pixel order of the screen.
+     * All other text yields a QImage::Format_Grayscale8 mask.
+     * @param text see @ref renderText
+     * @param font see @ref renderText
+     * @param pointSize see @ref renderText
+     * @param options see @ref renderText
+     * @param token optional, see @ref FontShaping::FontShaping
+     * @return the coverage mask, which is null if the rendering became obsolete
+     */
+    QImage renderMask(const char* text,
+                      const char* font,
+                      double pointSize,
+                      KXftConfig options,
+                      const CancellationToken* token = nullptr);
+
+    /**
+     * @brief paintMask blends the pen color onto a canvas as given by a coverage mask.
+     * @param mask rendered by @ref renderMask
+     * @param painter for the canvas and the pen color
+     * @param x left edge of the text on the canvas
+     * @param y top edge of the text on the canvas
+     */
+    static void paintMask(const QImage& mask, const GlyphPainter& painter, int x, int y);
+
+    /**
+     * @brief tintMask colorizes a coverage mask.
+     * @return the text as rendered by @ref renderText with the same colors
+     */
+    static QImage tintMask(const QImage& mask, QColor background, QColor pen);
 };
 
 #endif // FREETYPE_RENDERER_H
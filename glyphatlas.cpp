@@ -0,0 +1,262 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Packed storage for rendered glyphs.
+ */
+
+#include "glyphatlas.h"
+
+#include <climits>
+#include <cstring>
+
+/*************/
+/* AtlasPage */
+/*************/
+
+AtlasPage::AtlasPage(int width, int height)
+    : width(width), height(height), data(new unsigned char[width * height]()), lastUse(0)
+{
+    skyline.append(SkylineSegment{ 0, 0, width });
+}
+
+AtlasPage::~AtlasPage()
+{
+    delete[] data;
+}
+
+bool AtlasPage::allocate(int width, int height, QPoint* position)
+{
+    int bestIndex = -1;
+    int bestX = 0;
+    int bestY = INT_MAX;
+    int bestWidth = INT_MAX;
+
+    // find the lowest position, prefer narrow segments to keep wide gaps for wide glyphs
+    for (int i = 0; i < skyline.size(); ++i) {
+        int x = skyline[i].x;
+        if (x + width > this->width) {
+            break;
+        }
+        int y = 0;
+        for (int j = i, covered = 0; covered < width && j < skyline.size(); ++j) {
+            y = qMax(y, skyline[j].y);
+            covered += skyline[j].width;
+        }
+        if (y + height > this->height) {
+            continue;
+        }
+        if (y < bestY || (y == bestY && skyline[i].width < bestWidth)) {
+            bestIndex = i;
+            bestX = x;
+            bestY = y;
+            bestWidth = skyline[i].width;
+        }
+    }
+    if (bestIndex < 0) {
+        return false;
+    }
+
+    // raise the contour where the new rectangle is placed
+    skyline.insert(bestIndex, SkylineSegment{ bestX, bestY + height, width });
+    int end = bestX + width;
+    int i = bestIndex + 1;
+    while (i < skyline.size() && skyline[i].x < end) {
+        int overlap = end - skyline[i].x;
+        if (overlap >= skyline[i].width) {
+            skyline.remove(i);
+        } else {
+            skyline[i].x += overlap;
+            skyline[i].width -= overlap;
+            break;
+        }
+    }
+
+    // merge neighbouring segments of the same height
+    for (int j = 0; j + 1 < skyline.size();) {
+        if (skyline[j].y == skyline[j + 1].y) {
+            skyline[j].width += skyline[j + 1].width;
+            skyline.remove(j + 1);
+        } else {
+            ++j;
+        }
+    }
+
+    *position = QPoint(bestX, bestY);
+    return true;
+}
+
+unsigned char* AtlasPage::scanLine(int y) const
+{
+    return data + y * width;
+}
+
+int AtlasPage::getWidth() const
+{
+    return width;
+}
+
+int AtlasPage::getHeight() const
+{
+    return height;
+}
+
+int AtlasPage::getByteSize() const
+{
+    return width * height;
+}
+
+/***************/
+/* AtlasRegion */
+/***************/
+
+AtlasRegion::AtlasRegion()
+{
+}
+
+AtlasRegion::AtlasRegion(const QSharedPointer<AtlasPage>& page, const QRect& rect)
+    : page(page), rect(rect)
+{
+}
+
+bool AtlasRegion::isNull() const
+{
+    return page.isNull();
+}
+
+/**************/
+/* GlyphAtlas */
+/**************/
+
+GlyphAtlas::GlyphAtlas(int maxBytes, int pageWidth, int pageHeight)
+    : maxBytes(maxBytes)
+    , pageWidth(pageWidth)
+    , pageHeight(pageHeight)
+    , residentBytes(0)
+    , useCounter(0)
+{
+}
+
+AtlasRegion GlyphAtlas::allocate(FT_Pixel_Mode pixelMode, int width, int height)
+{
+    auto& modePages = pages[pixelMode];
+    QPoint position;
+
+    // try the most recently created pages first, older ones are likely full
+    for (int i = modePages.size() - 1; i >= 0; --i) {
+        auto& page = modePages[i];
+        if (page->allocate(width, height, &position)) {
+            page->lastUse = ++useCounter;
+            return AtlasRegion(page, QRect(position, QSize(width, height)));
+        }
+    }
+
+    int newWidth = qMax(width, pageWidth);
+    int newHeight = qMax(height, pageHeight);
+    if (residentBytes > 0 && residentBytes + newWidth * newHeight > maxBytes) {
+        return AtlasRegion();
+    }
+    auto page = QSharedPointer<AtlasPage>::create(newWidth, newHeight);
+    residentBytes += page->getByteSize();
+    modePages.append(page);
+
+    page->allocate(width, height, &position);
+    page->lastUse = ++useCounter;
+    return AtlasRegion(page, QRect(position, QSize(width, height)));
+}
+
+void GlyphAtlas::touch(AtlasPage* page)
+{
+    page->lastUse = ++useCounter;
+}
+
+QSharedPointer<AtlasPage> GlyphAtlas::evictLeastRecentlyUsedPage()
+{
+    QList<QSharedPointer<AtlasPage>>* oldestList = nullptr;
+    int oldestIndex = -1;
+    for (auto it = pages.begin(); it != pages.end(); ++it) {
+        auto& modePages = it.value();
+        for (int i = 0; i < modePages.size(); ++i) {
+            if (oldestList == nullptr
+                || modePages[i]->lastUse < (*oldestList)[oldestIndex]->lastUse) {
+                oldestList = &modePages;
+                oldestIndex = i;
+            }
+        }
+    }
+    if (oldestList == nullptr) {
+        return QSharedPointer<AtlasPage>();
+    }
+    auto page = oldestList->takeAt(oldestIndex);
+    residentBytes -= page->getByteSize();
+    return page;
+}
+
+void GlyphAtlas::clear()
+{
+    pages.clear();
+    residentBytes = 0;
+}
+
+int GlyphAtlas::getResidentBytes() const
+{
+    return residentBytes;
+}
+
+int GlyphAtlas::getPageCount() const
+{
+    int count = 0;
+    for (const auto& modePages : pages) {
+        count += modePages.size();
+    }
+    return count;
+}
+
+QImage GlyphAtlas::getDebugImage(FT_Pixel_Mode pixelMode) const
+{
+    const auto modePages = pages.value(pixelMode);
+    if (modePages.isEmpty()) {
+        return QImage();
+    }
+
+    bool monochrome = pixelMode == FT_PIXEL_MODE_MONO;
+    int width = 0;
+    int height = 0;
+    for (const auto& page : modePages) {
+        width = qMax(width, monochrome ? 8 * page->getWidth() : page->getWidth());
+        height += page->getHeight();
+    }
+
+    QImage result(width, height, QImage::Format_Grayscale8);
+    result.fill(0);
+    int offset = 0;
+    for (const auto& page : modePages) {
+        for (int y = 0; y < page->getHeight(); ++y) {
+            const unsigned char* source = page->scanLine(y);
+            unsigned char* target = result.scanLine(offset + y);
+            if (monochrome) {
+                for (int x = 0; x < 8 * page->getWidth(); ++x) {
+                    target[x] = (source[x / 8] >> (7 - x % 8) & 0x1) ? 255 : 0;
+                }
+            } else {
+                memcpy(target, source, static_cast<size_t>(page->getWidth()));
+            }
+        }
+        offset += page->getHeight();
+    }
+    return result;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLYPHATLAS_H
+#define GLYPHATLAS_H
+
+extern "C" {
+#include <ft2build.h>
+#include FT_FREETYPE_H
+}
+
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QPoint>
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+/**
+ * @brief The AtlasPage class is a large block of glyph data, which is shared by many glyphs.
+ *
+ * A page is a plain byte matrix. It has no notion of pixel formats, all glyphs stored on one page
+ * are expected to have the same format though. Space is handed out by a skyline allocator: the
+ * page keeps track of the upper contour of all allocated rectangles and places new rectangles as
+ * far up as possible. Space cannot be given back, instead whole pages are dropped.
+ */
+class AtlasPage
+{
+private:
+    /**
+     * @brief The SkylineSegment struct is a horizontal part of the upper contour of allocations.
+     */
+    struct SkylineSegment
+    {
+        int x;
+        int y;
+        int width;
+    };
+
+    const int width;
+    const int height;
+    unsigned char* data;
+
+    /**
+     * @brief skyline covers the whole width of the page ordered from left to right.
+     */
+    QVector<SkylineSegment> skyline;
+
+public:
+    /**
+     * @param width of the page in bytes
+     * @param height of the page in rows
+     */
+    AtlasPage(int width, int height);
+    ~AtlasPage();
+
+    AtlasPage& operator=(const AtlasPage&) = delete;
+    AtlasPage(const AtlasPage&) = delete;
+
+    /**
+     * @brief allocate reserves a rectangle on the page.
+     * @param width of the rectangle in bytes
+     * @param height of the rectangle in rows
+     * @param position receives the upper left corner of the reserved rectangle
+     * @return false if the page has not enough space left
+     */
+    bool allocate(int width, int height, QPoint* position);
+
+    /**
+     * @return pointer to the first byte of the given row
+     */
+    unsigned char* scanLine(int y) const;
+
+    int getWidth() const;
+    int getHeight() const;
+    int getByteSize() const;
+
+    /**
+     * @brief lastUse is a stamp from the owning atlas, which is used for eviction.
+     */
+    quint64 lastUse;
+};
+
+/**
+ * @brief The AtlasRegion class denotes a reserved rectangle on an atlas page.
+ */
+class AtlasRegion
+{
+public:
+    AtlasRegion();
+    AtlasRegion(const QSharedPointer<AtlasPage>& page, const QRect& rect);
+
+    /**
+     * @brief page is shared, so the data stays valid after the page has been evicted.
+     */
+    QSharedPointer<AtlasPage> page;
+    QRect rect;
+
+    bool isNull() const;
+};
+
+/**
+ * @brief The GlyphAtlas class manages the pages for rendered glyphs.
+ *
+ * There are separate pages for every FreeType pixel mode, since the interpretation of the bytes
+ * differs. The atlas is bounded by a byte budget. Once it is exhausted, allocation fails and the
+ * owner has to evict a page, see @ref evictLeastRecentlyUsedPage. The atlas is not thread safe.
+ */
+class GlyphAtlas
+{
+private:
+    QHash<int, QList<QSharedPointer<AtlasPage>>> pages;
+    const int maxBytes;
+    const int pageWidth;
+    const int pageHeight;
+    int residentBytes;
+    quint64 useCounter;
+
+public:
+    /**
+     * @param maxBytes memory budget for all pages
+     * @param pageWidth width of a regular page in bytes
+     * @param pageHeight height of a regular page in rows
+     */
+    explicit GlyphAtlas(int maxBytes, int pageWidth = 1024, int pageHeight = 256);
+
+    /**
+     * @brief allocate reserves space for a glyph.
+     *
+     * A new page is created, if no page of the pixel mode has enough space left and the budget
+     * allows it. Glyphs larger than a regular page get a page of their own.
+     * @param pixelMode FreeType pixel mode of the glyph data
+     * @param width in bytes
+     * @param height in rows
+     * @return the reserved region or a null region, if the budget is exhausted
+     */
+    AtlasRegion allocate(FT_Pixel_Mode pixelMode, int width, int height);
+
+    /**
+     * @brief touch marks a page as recently used.
+     */
+    void touch(AtlasPage* page);
+
+    /**
+     * @brief evictLeastRecentlyUsedPage removes the page, which was not used for the longest time,
+     * from the atlas.
+     * @return the removed page or a null pointer, if the atlas is empty
+     */
+    QSharedPointer<AtlasPage> evictLeastRecentlyUsedPage();
+
+    /**
+     * @brief clear removes all pages. Regions keep their pages alive, until they are released.
+     */
+    void clear();
+
+    int getResidentBytes() const;
+    int getPageCount() const;
+
+    /**
+     * @brief getDebugImage assembles all pages of a pixel mode into one image for inspection.
+     *
+     * Pages are stacked vertically. Bytes are shown as gray values, for monochrome pages every bit
+     * is expanded to a pixel.
+     * @return gray scale image, which is null if there are no pages of the pixel mode
+     */
+    QImage getDebugImage(FT_Pixel_Mode pixelMode) const;
+};
+
+#endif // GLYPHATLAS_H
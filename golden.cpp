@@ -0,0 +1,372 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Golden image check of the text rendering with time budgets.
+ *
+ * Renders every combination of font, size, rendering variant and text with
+ * FreeTypeFontPreviewRenderer::renderText and compares the result against the reference image in
+ * the golden directory. The rendering variants are all combinations of antialiasing, hint style
+ * and sub-pixel order, which remain distinct after normalization. A case fails, when a pixel
+ * differs by more than the tolerance in any channel, or when one of its timings exceeds the
+ * recorded budget times the budget factor.
+ *
+ * Two timings are taken per case: a cold rendering after all caches were dropped and with a fresh
+ * FreeType library, which includes font resolution, opening the face, shaping and rastering, and
+ * the median of warm renderings, which are served from the caches.
+ *
+ * The reference images are named family-size-antialiasing.hintstyle.subpixel-text.png, where
+ * the settings are the values of the KXftConfig enums and text is the position of the text. The
+ * budgets are kept in budgets.json of the same directory, as an object with the cold and warm
+ * time in microseconds per case. Cases and timings without a budget are not timed. Both are
+ * written with --update, which should be run on the machine, where the check runs later.
+ *
+ * The exit code is 0, if all cases pass, 1 on failures and 77, if the directory holds no
+ * reference images at all, which ctest reports as skipped.
+ */
+
+#include "freetype-renderer.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QVector>
+
+#include <algorithm>
+
+namespace
+{
+
+/** exit code of a check, which could not run, see SKIP_RETURN_CODE of ctest */
+const int SKIPPED = 77;
+
+struct GoldenCase
+{
+    QString name;
+    QString font;
+    double size;
+    KXftConfig options;
+    QString text;
+};
+
+/**
+ * The rendering variants, one for every distinct combination of settings after the
+ * normalization of PreviewParameters::canonicalKey. Without antialiasing only hinting off or full
+ * hinting remain, with antialiasing medium hinting falls back to slight hinting, whereas an unset
+ * hint style is kept and left to FreeType.
+ */
+QList<KXftConfig> renderVariants()
+{
+    using AA = KXftConfig::AntiAliasing;
+    using Hint = KXftConfig::Hint;
+    using SubPixel = KXftConfig::SubPixel;
+    const auto hinting = KXftConfig::Hinting::Enabled;
+    QList<KXftConfig> variants;
+    for (auto hintstyle : { Hint::None, Hint::Full }) {
+        variants.append(KXftConfig(AA::Disabled, hinting, hintstyle, SubPixel::None, 96u, 96u));
+    }
+    for (auto hintstyle : { Hint::NotSet, Hint::None, Hint::Slight, Hint::Full }) {
+        for (auto subpixel : { SubPixel::None, SubPixel::Rgb, SubPixel::Bgr, SubPixel::Vrgb,
+                               SubPixel::Vbgr }) {
+            variants.append(KXftConfig(AA::Enabled, hinting, hintstyle, subpixel, 96u, 96u));
+        }
+    }
+    return variants;
+}
+
+QList<GoldenCase>
+goldenCases(const QStringList& fonts, const QList<double>& sizes, const QStringList& texts)
+{
+    QList<GoldenCase> cases;
+    for (const auto& font : fonts) {
+        for (auto size : sizes) {
+            for (const auto& options : renderVariants()) {
+                for (int i = 0; i < texts.size(); ++i) {
+                    auto name = QString("%1-%2-%3.%4.%5-%6")
+                                    .arg(QString(font).replace(' ', '_'))
+                                    .arg(size)
+                                    .arg(static_cast<int>(options.antialiasingSetting))
+                                    .arg(static_cast<int>(options.hintstyleSetting))
+                                    .arg(static_cast<int>(options.subpixelSetting))
+                                    .arg(i);
+                    cases.append(GoldenCase{ name, font, size, options, texts.at(i) });
+                }
+            }
+        }
+    }
+    return cases;
+}
+
+/**
+ * Compare two images channel by channel.
+ * @param maxDelta receives the largest difference of a channel
+ * @return number of pixels, which differ by more than the tolerance, or -1 for different sizes
+ */
+int compare(const QImage& actual, const QImage& expected, int tolerance, int* maxDelta)
+{
+    *maxDelta = 0;
+    if (actual.size() != expected.size()) {
+        return -1;
+    }
+    auto a = actual.convertToFormat(QImage::Format_RGB32);
+    auto b = expected.convertToFormat(QImage::Format_RGB32);
+    int differing = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        auto lineA = reinterpret_cast<const QRgb*>(a.constScanLine(y));
+        auto lineB = reinterpret_cast<const QRgb*>(b.constScanLine(y));
+        for (int x = 0; x < a.width(); ++x) {
+            int delta = qMax(qAbs(qRed(lineA[x]) - qRed(lineB[x])),
+                             qMax(qAbs(qGreen(lineA[x]) - qGreen(lineB[x])),
+                                  qAbs(qBlue(lineA[x]) - qBlue(lineB[x]))));
+            *maxDelta = qMax(*maxDelta, delta);
+            if (delta > tolerance) {
+                ++differing;
+            }
+        }
+    }
+    return differing;
+}
+
+struct Timings
+{
+    /** @brief time of a rendering without cached data in microseconds */
+    double cold;
+    /** @brief median time of the renderings from the caches in microseconds */
+    double warm;
+};
+
+/**
+ * Drop everything, which the renderings of earlier cases left in the caches.
+ */
+void clearCaches()
+{
+    FontManagement::instance().clear();
+    ShapedRunCache::instance().clear();
+    GlyphCache::instance().clear();
+}
+
+/**
+ * Render a case without any cached data, the way FreeTypeFontPreviewRenderer::renderText does.
+ * The library is created before the timer starts, so opening the face is measured, but not the
+ * initialization of FreeType.
+ * @param micros receives the time in microseconds
+ */
+QImage renderCold(const QByteArray& text, const QByteArray& font, const GoldenCase& c,
+                  double* micros)
+{
+    clearCaches();
+    FreeTypeLibrary library;
+    QElapsedTimer timer;
+    timer.start();
+    FontShaping shaping(&library, &FontManagement::instance(), text.constData(), font.constData(),
+                        c.size, c.options);
+    QImage canvas(shaping.getCanvasSize(), QImage::Format_RGB32);
+    canvas.fill(Qt::white);
+    FreeTypeFontPreviewRenderer::paintText(shaping, GlyphPainter(&canvas, Qt::black), 0, 0);
+    *micros = timer.nsecsElapsed() / 1e3;
+    return canvas;
+}
+
+/**
+ * Render a case cold and measure the median time of the warm renderings after the cold one.
+ * @param coldImage receives the image of the cold rendering
+ * @return the image of the warm rendering, which is compared to the reference
+ */
+QImage render(FreeTypeFontPreviewRenderer* renderer,
+              const GoldenCase& c,
+              int runs,
+              QImage* coldImage,
+              Timings* timings)
+{
+    auto text = c.text.toUtf8();
+    auto font = c.font.toUtf8();
+    *coldImage = renderCold(text, font, c, &timings->cold);
+    auto image = renderer->renderText(text.constData(), font.constData(), c.size, c.options,
+                                      Qt::white, Qt::black);
+    QVector<qint64> times;
+    for (int i = 0; i < runs; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        renderer->renderText(text.constData(), font.constData(), c.size, c.options, Qt::white,
+                             Qt::black);
+        times.append(timer.nsecsElapsed());
+    }
+    std::sort(times.begin(), times.end());
+    timings->warm = times.isEmpty() ? 0 : times.at(times.size() / 2) / 1e3;
+    return image;
+}
+
+/**
+ * Check a timing against its budget.
+ * @param budgets of the case, may lack the timing
+ * @param kind cold or warm
+ * @return the failure, empty if the timing is within the budget or has none
+ */
+QString
+checkBudget(const QJsonObject& budgets, const QString& kind, double micros, double factor)
+{
+    if (factor <= 0 || !budgets.contains(kind)) {
+        return QString();
+    }
+    auto budget = budgets.value(kind).toDouble();
+    if (budget <= 0 || micros <= budget * factor) {
+        return QString();
+    }
+    return QString("%1 %2 us exceed the budget of %3 us").arg(kind).arg(micros).arg(budget);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // fonts do not need a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Compare rendered texts against reference images.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("directory", "Directory of the reference images and budgets.");
+    QCommandLineOption updateOption("update", "Write the reference images and budgets.");
+    QCommandLineOption fontsOption("fonts", "Comma separated font names.", "fonts",
+                                   "DejaVu Sans");
+    QCommandLineOption sizesOption("sizes", "Comma separated sizes in points.", "sizes",
+                                   "8,10,14");
+    QCommandLineOption textOption("text", "Text to render, may be given several times.", "text");
+    QCommandLineOption toleranceOption("tolerance", "Largest accepted difference of a channel.",
+                                       "delta", "0");
+    QCommandLineOption factorOption("budget-factor",
+                                    "Accepted factor of the budget, 0 disables the time check.",
+                                    "factor", "1.5");
+    QCommandLineOption runsOption("runs", "Timed renderings per case.", "count", "5");
+    parser.addOptions({ updateOption, fontsOption, sizesOption, textOption, toleranceOption,
+                        factorOption, runsOption });
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    if (parser.positionalArguments().isEmpty()) {
+        parser.showHelp(1);
+    }
+    QDir directory(parser.positionalArguments().first());
+    bool update = parser.isSet(updateOption);
+    if (update && !directory.mkpath(".")) {
+        err << "cannot create " << directory.path() << "\n";
+        return 1;
+    }
+
+    QStringList texts = parser.values(textOption);
+    if (texts.isEmpty()) {
+        texts = QStringList{ "Hamburgefonstiv", "fi ffl AVAWAY 0123", "Äöü ßẞ çñ" };
+    }
+    QList<double> sizes;
+    for (const auto& value : parser.value(sizesOption).split(',', QString::SkipEmptyParts)) {
+        sizes.append(value.trimmed().toDouble());
+    }
+    auto cases =
+        goldenCases(parser.value(fontsOption).split(',', QString::SkipEmptyParts), sizes, texts);
+    auto tolerance = parser.value(toleranceOption).toInt();
+    auto factor = parser.value(factorOption).toDouble();
+    auto runs = qMax(1, parser.value(runsOption).toInt());
+
+    QFile budgetFile(directory.filePath("budgets.json"));
+    QJsonObject budgets;
+    if (budgetFile.open(QIODevice::ReadOnly)) {
+        budgets = QJsonDocument::fromJson(budgetFile.readAll()).object();
+        budgetFile.close();
+    }
+
+    if (!update && directory.entryList({ "*.png" }, QDir::Files).isEmpty()) {
+        err << "no reference images in " << directory.path() << ", record them with --update\n";
+        return SKIPPED;
+    }
+
+    FreeTypeFontPreviewRenderer renderer;
+    int failures = 0;
+    for (const auto& c : cases) {
+        QImage coldImage;
+        Timings timings;
+        auto image = render(&renderer, c, runs, &coldImage, &timings);
+        auto path = directory.filePath(c.name + ".png");
+
+        if (update) {
+            if (image.isNull() || !image.save(path, "PNG")) {
+                err << "cannot write " << path << "\n";
+                ++failures;
+            }
+            QJsonObject budget;
+            budget["cold"] = timings.cold;
+            budget["warm"] = timings.warm;
+            budgets[c.name] = budget;
+            continue;
+        }
+
+        QString failure;
+        QImage expected(path);
+        int maxDelta = 0;
+        if (expected.isNull()) {
+            failure = "no reference image";
+        } else if (coldImage != image) {
+            failure = "cold and warm renderings differ";
+        } else {
+            auto differing = compare(image, expected, tolerance, &maxDelta);
+            if (differing < 0) {
+                failure = QString("size %1x%2 instead of %3x%4")
+                              .arg(image.width())
+                              .arg(image.height())
+                              .arg(expected.width())
+                              .arg(expected.height());
+            } else if (differing > 0) {
+                failure = QString("%1 pixels differ, by %2 at most").arg(differing).arg(maxDelta);
+            }
+        }
+        auto budget = budgets.value(c.name).toObject();
+        if (failure.isEmpty()) {
+            failure = checkBudget(budget, "cold", timings.cold, factor);
+        }
+        if (failure.isEmpty()) {
+            failure = checkBudget(budget, "warm", timings.warm, factor);
+        }
+
+        if (failure.isEmpty()) {
+            out << "PASS " << c.name << " cold " << timings.cold << " us, warm " << timings.warm
+                << " us\n";
+        } else {
+            out << "FAIL " << c.name << ": " << failure << "\n";
+            ++failures;
+        }
+    }
+
+    if (update) {
+        if (!budgetFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            err << "cannot write " << budgetFile.fileName() << "\n";
+            return 1;
+        }
+        budgetFile.write(QJsonDocument(budgets).toJson());
+        out << cases.size() << " reference images written\n";
+    } else {
+        out << cases.size() - failures << " passed, " << failures << " failed\n";
+    }
+    return failures ? 1 : 0;
+}
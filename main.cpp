@@ -17,6 +17,7 @@
 
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
+#include <QQmlContext>
 
 #include "menupreviewimageprovider.h"
 
@@ -26,8 +27,14 @@ int main(int argc, char *argv[]) {
 
     QGuiApplication app(argc, argv);
 
+    // families offered for selection, their previews are prerendered when stepping through them
+    QStringList families{ "DejaVu Sans", "Arial", "Wingdings" };
+    auto previewProvider = new AsyncMenuPreviewImageProvider;
+    previewProvider->setFamilies(families);
+
     QQmlApplicationEngine engine;
-    engine.addImageProvider(QLatin1String("renderpreview"), new MenuPreviewImageProvider);
+    engine.rootContext()->setContextProperty(QStringLiteral("previewFamilies"), families);
+    engine.addImageProvider(QLatin1String("renderpreview"), previewProvider);
     engine.load(QUrl(QStringLiteral("qrc:///qml/qmlDeploy/main.qml")));
     if (engine.rootObjects().isEmpty())
         return -1;
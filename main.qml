@@ -53,7 +53,7 @@ Window {
                         ComboBox {
                             id: fontBox
                             editable: true
-                            model: ["DejaVu Sans", "Arial", "Wingdings"]
+                            model: previewFamilies
                         }
                     }
                     Column {
@@ -82,17 +82,48 @@ Window {
                     id: previewFrame
                     Grid {
                         id: previewArea
-                        rows: 2
+                        columns: 5
                         spacing: 4
+                        readonly property int previewCount: 10
+                        // render natively for the screen instead of letting Qt scale the previews
+                        property int dpi: Math.round(Screen.logicalPixelDensity * 25.4)
+                        property real devicePixelRatio: Screen.devicePixelRatio
+                        // all previews are rendered in one request
+                        property string sheetSource: previewSheet(fontBox.currentText,
+                                                                  sizeBox.currentText)
+
+                        function previewAntialiasing(index) {
+                            return index % 5 == 0 ? 1 : 2
+                        }
+                        function previewHintstyle(index) {
+                            return index == 0 ? 0 : ((index + 2) % 4) + 1
+                        }
+                        function previewSubpixel(index) {
+                            return index % 5 <= 2 ? 1 : 2
+                        }
+                        // see AsyncMenuPreviewImageProvider::requestImageResponse
+                        function previewSheet(family, size) {
+                            var id = ["sheet", columns, family, size, dpi, devicePixelRatio]
+                            for (var i = 0; i < previewCount; ++i) {
+                                id.push(previewAntialiasing(i) + "." + previewHintstyle(i) + "."
+                                        + previewSubpixel(i))
+                            }
+                            return "image://renderpreview/" + id.join("/")
+                        }
 
                         Repeater {
-                            model: 10
+                            model: previewArea.previewCount
                             SelectablePreview {
                                 fontFamily: fontBox.currentText
                                 fontSize: sizeBox.currentText
-                                antialiasing: index % 5 == 0 ? 1 : 2
-                                hintstyle: index == 0 ? 0 : ((index + 2) % 4)+1
-                                subpixel: index % 5 <= 2 ? 1 : 2
+                                antialiasing: previewArea.previewAntialiasing(index)
+                                hintstyle: previewArea.previewHintstyle(index)
+                                subpixel: previewArea.previewSubpixel(index)
+                                sheetSource: previewArea.sheetSource
+                                sheetColumns: previewArea.columns
+                                sheetRows: Math.ceil(previewArea.previewCount / previewArea.columns)
+                                cellIndex: index
+                                devicePixelRatio: previewArea.devicePixelRatio
                             }
                         }
                         ButtonGroup {
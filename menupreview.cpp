@@ -17,23 +17,74 @@
 
 #include "menupreview.h"
 #include "freetype-renderer.h"
+#include "trace.h"
 
 #include <QApplication>
 #include <QGridLayout>
 #include <QIcon>
+#include <QMutex>
 #include <QPainter>
+#include <QRunnable>
+#include <QSemaphore>
 #include <QtMath>
 
+#include <limits>
+
 namespace
 {
 static const int MAX_PREVIEW_WIDTH = 120;
 static const int MAX_PREVIEW_HIGHT = 240;
+
+/**
+ * Shared state of a batch rendering. Every variant is claimed by exactly one thread. Helper tasks
+ * may start after all variants are done, hence the state is reference counted.
+ */
+struct Batch
+{
+    MenuPreviewRenderer* renderer;
+    QList<PreviewParameters> variants;
+    QSize requestedSize;
+    const CancellationToken* token;
+    QVector<QImage> images;
+    QAtomicInt next;
+    QSemaphore completed;
+
+    void work()
+    {
+        QImage* results = images.data();
+        for (int i = next.fetchAndAddRelaxed(1); i < variants.size();
+             i = next.fetchAndAddRelaxed(1)) {
+            results[i] = renderer->getImage(variants.at(i), requestedSize, token);
+            completed.release();
+        }
+    }
+};
+
+class BatchHelper : public QRunnable
+{
+private:
+    QSharedPointer<Batch> batch;
+
+public:
+    explicit BatchHelper(const QSharedPointer<Batch>& batch) : batch(batch)
+    {
+    }
+
+    void run() override
+    {
+        batch->work();
+    }
+};
 }
 
 PreviewParameters::PreviewParameters(const QString& fontFamily,
                                      double pointSize,
-                                     KXftConfig options)
-    : fontFamily(fontFamily), pointSize(pointSize), options(options)
+                                     KXftConfig options,
+                                     qreal devicePixelRatio)
+    : fontFamily(fontFamily)
+    , pointSize(pointSize)
+    , options(options)
+    , devicePixelRatio(devicePixelRatio)
 {
 }
 
@@ -46,20 +97,37 @@ PreviewParameters PreviewParameters::fromString(const QString& id, uint dpiH, ui
     auto hintingSetting = KXftConfig::Hinting::Enabled;
     auto hintstyleSetting = KXftConfig::Hint::None;
     auto subpixelSetting = KXftConfig::SubPixel::None;
+    qreal devicePixelRatio = 1;
 
-    if (fragments.length() <= 5) {
+    if (fragments.length() >= 5) {
         fontFamily = fragments[0];
         pointSize = fragments[1].toFloat();
         antialiasingSetting = static_cast<KXftConfig::AntiAliasing>(fragments[2].toInt());
         hintstyleSetting = static_cast<KXftConfig::Hint>(fragments[3].toInt());
         subpixelSetting = static_cast<KXftConfig::SubPixel>(fragments[4].toInt());
     }
+    if (fragments.length() >= 6) {
+        bool valid = false;
+        uint dpi = fragments[5].toUInt(&valid);
+        if (valid && dpi > 0) {
+            dpiH = dpi;
+            dpiV = dpi;
+        }
+    }
+    if (fragments.length() >= 7) {
+        bool valid = false;
+        qreal ratio = fragments[6].toDouble(&valid);
+        if (valid && ratio > 0) {
+            devicePixelRatio = ratio;
+        }
+    }
     if (hintstyleSetting == KXftConfig::Hint::None) {
         hintingSetting = KXftConfig::Hinting::Disabled;
     }
     return PreviewParameters(fontFamily, pointSize,
                              KXftConfig(antialiasingSetting, hintingSetting, hintstyleSetting,
-                                        subpixelSetting, dpiH, dpiV));
+                                        subpixelSetting, dpiH, dpiV),
+                             devicePixelRatio);
 }
 
 QString PreviewParameters::toFormatetString()
@@ -72,6 +140,50 @@ QString PreviewParameters::toFormatetString()
         .arg(typeface, antialiasing, hint, subpixel);
 }
 
+QString PreviewParameters::variantKey() const
+{
+    return QString("%1/%2/%3")
+        .arg(static_cast<int>(options.antialiasingSetting))
+        .arg(static_cast<int>(options.hintstyleSetting))
+        .arg(static_cast<int>(options.subpixelSetting));
+}
+
+QString PreviewParameters::canonicalKey() const
+{
+    // normalize the way FreeTypeParameters and FontShaping interpret the settings
+    auto antialiasing = options.antialiasingSetting;
+    auto hinting = options.hintingSetting;
+    auto hintstyle = options.hintstyleSetting;
+    auto subpixel = options.subpixelSetting;
+    if (antialiasing == KXftConfig::AntiAliasing::Disabled) {
+        subpixel = KXftConfig::SubPixel::None;
+        if (hintstyle == KXftConfig::Hint::None) {
+            hinting = KXftConfig::Hinting::Disabled;
+        } else {
+            hintstyle = KXftConfig::Hint::Full;
+        }
+    } else {
+        antialiasing = KXftConfig::AntiAliasing::Enabled;
+        hinting = hintstyle == KXftConfig::Hint::None ? KXftConfig::Hinting::Disabled
+                                                      : KXftConfig::Hinting::Enabled;
+        if (hintstyle == KXftConfig::Hint::Medium) {
+            hintstyle = KXftConfig::Hint::Slight;
+        }
+        if (subpixel == KXftConfig::SubPixel::NotSet) {
+            subpixel = KXftConfig::SubPixel::None;
+        }
+    }
+    return QString("%1/%2/%3/%4/%5/%6/%7/%8")
+        .arg(fontFamily.trimmed())
+        .arg(QString::number(pointSize))
+        .arg(static_cast<int>(antialiasing))
+        .arg(static_cast<int>(hinting))
+        .arg(static_cast<int>(hintstyle))
+        .arg(static_cast<int>(subpixel))
+        .arg(options.dpiH)
+        .arg(options.dpiV);
+}
+
 EntryMockup::EntryMockup(const QString& label, const QString& iconName)
     : label{ label }, iconName{ iconName }
 {
@@ -122,49 +234,216 @@ int MenuMockup::length() const
     return entries.length();
 }
 
+IconCache::IconCache(int maxBytes) : cache(maxBytes), hits(0), misses(0)
+{
+}
+
+IconCache& IconCache::instance()
+{
+    static IconCache sharedCache;
+    return sharedCache;
+}
+
+QImage IconCache::icon(const QString& name, int size, qreal devicePixelRatio)
+{
+    // the icon theme lookup is not thread safe, hence rasterization happens under the lock
+    QMutexLocker locker(&mutex);
+    if (QIcon::themeName() != themeName) {
+        cache.clear();
+        themeName = QIcon::themeName();
+    }
+
+    const int deviceSize = qRound(size * devicePixelRatio);
+    auto key = QString("%1@%2").arg(name).arg(deviceSize);
+    auto cached = cache.object(key);
+    if (cached != nullptr) {
+        ++hits;
+        return *cached;
+    }
+    ++misses;
+    auto image = QIcon::fromTheme(name)
+                     .pixmap(deviceSize, deviceSize)
+                     .toImage()
+                     .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    cache.insert(key, new QImage(image), qMax(1, static_cast<int>(image.sizeInBytes())));
+    return image;
+}
+
+quint64 IconCache::getHits()
+{
+    QMutexLocker locker(&mutex);
+    return hits;
+}
+
+quint64 IconCache::getMisses()
+{
+    QMutexLocker locker(&mutex);
+    return misses;
+}
+
 MenuPreviewRenderer::MenuPreviewRenderer(const QColor& background, int iconSize, int padding)
     : renderer(), iconSize(iconSize), padding(padding), background(background)
 {
 }
 
-QImage MenuPreviewRenderer::getImage(const PreviewParameters& parameters)
+QImage MenuPreviewRenderer::getImage(const PreviewParameters& parameters,
+                                     const QSize& requestedSize,
+                                     const CancellationToken* token)
 {
+    auto result = compose(parameters, parameters.devicePixelRatio, token);
+    if (result.isNull() || (requestedSize.width() <= 0 && requestedSize.height() <= 0)) {
+        return result;
+    }
+
+    // a dimension of zero or less is not constrained
+    qreal fit = std::numeric_limits<qreal>::max();
+    if (requestedSize.width() > 0) {
+        fit = qMin(fit, static_cast<qreal>(requestedSize.width()) / result.width());
+    }
+    if (requestedSize.height() > 0) {
+        fit = qMin(fit, static_cast<qreal>(requestedSize.height()) / result.height());
+    }
+    if (qAbs(fit - 1) < 0.01) {
+        return result;
+    }
+    return compose(parameters, parameters.devicePixelRatio * fit, token);
+}
+
+QList<QImage> MenuPreviewRenderer::getImages(const QList<PreviewParameters>& variants,
+                                             const QSize& requestedSize,
+                                             const CancellationToken* token,
+                                             QThreadPool* pool)
+{
+    auto batch = QSharedPointer<Batch>::create();
+    batch->renderer = this;
+    batch->requestedSize = requestedSize;
+    batch->token = token;
+
+    // equivalent variants are rendered once
+    QHash<QString, int> uniqueVariants;
+    QVector<int> indices;
+    for (const auto& variant : variants) {
+        auto key = QString("%1*%2").arg(variant.canonicalKey()).arg(variant.devicePixelRatio);
+        auto unique = uniqueVariants.find(key);
+        if (unique == uniqueVariants.end()) {
+            unique = uniqueVariants.insert(key, batch->variants.size());
+            batch->variants.append(variant);
+        }
+        indices.append(unique.value());
+    }
+    batch->images.resize(batch->variants.size());
+
+    const int helpers = qMin(batch->variants.size() - 1, pool->maxThreadCount());
+    for (int i = 0; i < helpers; ++i) {
+        pool->start(new BatchHelper(batch));
+    }
+    batch->work();
+    batch->completed.acquire(batch->variants.size());
+
+    QList<QImage> images;
+    for (int index : indices) {
+        images.append(batch->images.at(index));
+    }
+    return images;
+}
+
+QImage MenuPreviewRenderer::spriteSheet(const QList<QImage>& images, int columns) const
+{
+    QSize cell;
+    for (const auto& image : images) {
+        if (image.isNull()) {
+            return QImage();
+        }
+        cell = cell.expandedTo(image.size());
+    }
+    if (images.isEmpty() || columns < 1) {
+        return QImage();
+    }
+
+    const int rows = (images.size() + columns - 1) / columns;
+    QImage sheet(cell.width() * columns, cell.height() * rows,
+                 QImage::Format_ARGB32_Premultiplied);
+    sheet.fill(background);
+    QPainter p(&sheet);
+    for (int i = 0; i < images.size(); ++i) {
+        const auto& image = images.at(i);
+        // explicit rectangles in device pixels, the previews carry a device pixel ratio
+        p.drawImage(QRectF(QPointF((i % columns) * cell.width(), (i / columns) * cell.height()),
+                           image.size()),
+                    image, QRectF(QPointF(0, 0), image.size()));
+    }
+    p.end();
+    sheet.setDevicePixelRatio(images.first().devicePixelRatio());
+    return sheet;
+}
+
+QImage MenuPreviewRenderer::compose(const PreviewParameters& parameters,
+                                    qreal scale,
+                                    const CancellationToken* token)
+{
+    TRACE_SCOPE("compose");
     const auto menu = MenuMockup::basicExample();
-    QList<QImage> lables;
-    QList<QIcon> icons;
-    QSize dimensions(0, 2 * padding);
+    const auto& options = parameters.options;
+    KXftConfig scaledOptions(options.antialiasingSetting, options.hintingSetting,
+                             options.hintstyleSetting, options.subpixelSetting,
+                             static_cast<uint>(qRound(options.dpiH * scale)),
+                             static_cast<uint>(qRound(options.dpiV * scale)));
+    const int scaledIconSize = qRound(iconSize * scale);
+    const int scaledPadding = qRound(padding * scale);
+
+    // layout: labels are coverage masks, which are cached independent of the colors, so only
+    // the final blend depends on the color scheme
+    QList<QImage> labels;
+    QList<QImage> icons;
+    QSize dimensions(0, 2 * scaledPadding);
     for (int i = 0; i < menu.length(); ++i) {
-        auto image = renderer.renderText(menu.getLabel(i).toLocal8Bit(),
+        auto label = renderer.renderMask(menu.getLabel(i).toLocal8Bit(),
                                          parameters.fontFamily.toLocal8Bit(), parameters.pointSize,
-                                         parameters.options, background, Qt::black);
-        dimensions.rheight() += qMax(image.height(), iconSize) + 2 * padding;
-        dimensions.setWidth(qMax(dimensions.width(), image.width()));
-        lables.append(image);
-        icons.append(QIcon::fromTheme(menu.getIconName(i)));
-    }
-    dimensions.rwidth() += iconSize + 4 * padding;
-    QImage result(dimensions, QImage::Format_ARGB32);
+                                         scaledOptions, token);
+        if (token != nullptr && token->isObsolete()) {
+            return QImage();
+        }
+        auto labelSize = label.size();
+        dimensions.rheight() += qMax(labelSize.height(), scaledIconSize) + 2 * scaledPadding;
+        dimensions.setWidth(qMax(dimensions.width(), labelSize.width()));
+        labels.append(label);
+        icons.append(IconCache::instance().icon(menu.getIconName(i), iconSize, scale));
+    }
+    if (CancellationToken::abandon(token, RenderStage::Compose)) {
+        return QImage();
+    }
+    dimensions.rwidth() += scaledIconSize + 4 * scaledPadding;
+
+    // paint: icons and labels go straight into the final canvas, in the format the scene graph
+    // uploads without conversion
+    QImage result(dimensions, QImage::Format_ARGB32_Premultiplied);
     result.fill(background);
     QPainter p(&result);
-
-    for (int i = 0, y = padding; i < menu.length(); ++i) {
-        auto image = lables.at(i);
-        auto icon = icons.at(i).pixmap(iconSize, iconSize);
-        int heightOffset = (icon.height() - image.height()) / 2;
+    QList<int> labelOffsets;
+    for (int i = 0, y = scaledPadding; i < menu.length(); ++i) {
+        const int labelHeight = labels.at(i).height();
+        const auto& icon = icons.at(i);
+        int heightOffset = (icon.height() - labelHeight) / 2;
         bool iconIsSmaller = heightOffset < 0;
         if (iconIsSmaller) {
             heightOffset = (-heightOffset);
         }
 
-        p.drawPixmap(QRectF(padding, y + (iconIsSmaller ? heightOffset : 0), iconSize, iconSize),
-                     icon, QRectF(0, 0, iconSize, iconSize));
-
-        p.drawImage(QRectF(iconSize + 3 * padding, y + (!iconIsSmaller ? heightOffset : 0),
-                           image.width(), image.height()),
-                    image, QRectF(0, 0, image.width(), image.height()));
-        y += qMax(image.height(), iconSize) + 2 * padding;
+        p.drawImage(QRectF(scaledPadding, y + (iconIsSmaller ? heightOffset : 0),
+                           scaledIconSize, scaledIconSize),
+                    icon, QRectF(0, 0, scaledIconSize, scaledIconSize));
+        labelOffsets.append(y + (!iconIsSmaller ? heightOffset : 0));
+        y += qMax(labelHeight, scaledIconSize) + 2 * scaledPadding;
     }
     p.end();
+
+    GlyphPainter painter(&result, Qt::black);
+    for (int i = 0; i < menu.length(); ++i) {
+        FreeTypeFontPreviewRenderer::paintMask(labels.at(i), painter,
+                                               scaledIconSize + 3 * scaledPadding,
+                                               labelOffsets.at(i));
+    }
+    result.setDevicePixelRatio(parameters.devicePixelRatio);
     return result;
 }
 
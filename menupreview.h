@@ -22,10 +22,13 @@
 #include "kxftconfig.h"
 
 #include <QButtonGroup>
+#include <QCache>
 #include <QImage>
 #include <QList>
+#include <QMutex>
 #include <QPushButton>
 #include <QString>
+#include <QThreadPool>
 
 /**
  * @brief The PreviewParameters is a helper class for communication between qml and
@@ -38,9 +41,42 @@ public:
     double pointSize;
     KXftConfig options;
 
-    PreviewParameters(const QString& fontFamily, double pointSize, KXftConfig options);
-    static PreviewParameters fromString(const QString& id, uint dpiH = 72, uint dpiV = 72);
+    /**
+     * @brief devicePixelRatio of the screen, previews are rendered natively in device pixels.
+     */
+    qreal devicePixelRatio;
+
+    PreviewParameters(const QString& fontFamily,
+                      double pointSize,
+                      KXftConfig options,
+                      qreal devicePixelRatio = 1);
+
+    /**
+     * @brief fromString parses an image id.
+     *
+     * The id has the form family/size/antialiasing/hintstyle/subpixel[/dpi[/devicePixelRatio]],
+     * where the settings are the integer values of the KXftConfig enums.
+     * @param id from the image url
+     * @param dpiH horizontal resolution, if the id does not specify one
+     * @param dpiV vertical resolution, if the id does not specify one
+     */
+    static PreviewParameters fromString(const QString& id, uint dpiH = 96, uint dpiV = 96);
     QString toFormatetString();
+
+    /**
+     * @brief variantKey identifies the rendering settings without font and size, i.e. which of
+     * the previews is meant. A newer request for the same variant makes older ones obsolete.
+     */
+    QString variantKey() const;
+
+    /**
+     * @brief canonicalKey identifies the rendering result.
+     *
+     * Settings, which lead to the same rendering, are normalized, e.g. the sub-pixel order has no
+     * effect without anti-aliasing and medium hinting is the same as slight hinting. Hence
+     * equivalent preview ids share one key.
+     */
+    QString canonicalKey() const;
 };
 
 class EntryMockup
@@ -67,8 +103,53 @@ public:
     int length() const;
 };
 
+/**
+ * @brief The IconCache class keeps the rasterized icons of the menu mockup.
+ *
+ * Looking up an icon in the theme and rasterizing it is expensive and yields the same image for
+ * every preview. Therefore icons are rasterized once per name and size in device pixels, i.e.
+ * size times device pixel ratio, and shared by all renderers and threads. The cache is dropped as
+ * soon as the icon theme changes.
+ */
+class IconCache
+{
+private:
+    QMutex mutex;
+    QString themeName;
+    QCache<QString, QImage> cache;
+    quint64 hits;
+    quint64 misses;
+
+public:
+    /**
+     * @param maxBytes memory budget for the image data
+     */
+    explicit IconCache(int maxBytes = 4 * 1024 * 1024);
+
+    /**
+     * @return the cache shared by all renderers
+     */
+    static IconCache& instance();
+
+    /**
+     * @brief icon provides a themed icon, which is rasterized on first use.
+     * @param name of the icon in the theme
+     * @param size of the icon in device independent pixels
+     * @param devicePixelRatio scale of the rasterization
+     * @return the icon in device pixels and QImage::Format_ARGB32_Premultiplied
+     */
+    QImage icon(const QString& name, int size, qreal devicePixelRatio);
+
+    quint64 getHits();
+    quint64 getMisses();
+};
+
 class MenuPreviewArea;
 
+/**
+ * @brief The MenuPreviewRenderer class composes a mockup of a menu rendered with given font
+ * settings. Images may be requested from several threads at once.
+ */
 class MenuPreviewRenderer
 {
 private:
@@ -77,9 +158,59 @@ private:
     const int padding;
     const QColor background;
 
+    /**
+     * @brief compose renders the preview with fonts, icons and spacing scaled by the given factor.
+     */
+    QImage
+    compose(const PreviewParameters& parameters, qreal scale, const CancellationToken* token);
+
 public:
     MenuPreviewRenderer(const QColor& background, int iconSize = 16, int padding = 2);
-    QImage getImage(const PreviewParameters& parameters);
+    /**
+     * @brief getImage renders the preview in device pixels.
+     *
+     * If a size is requested, the preview is rendered again at a resolution, which fits into the
+     * requested size, instead of scaling the image. The result is approximately of the requested
+     * size, since hinting snaps glyphs to the pixel grid.
+     * @param parameters font and rendering settings
+     * @param requestedSize in device pixels, invalid for the natural size
+     * @param token optional, the composition is abandoned as soon as the token is obsolete
+     * @return the preview, which is null for abandoned renderings
+     */
+    QImage getImage(const PreviewParameters& parameters,
+                    const QSize& requestedSize = QSize(),
+                    const CancellationToken* token = nullptr);
+
+    /**
+     * @brief getImages renders the previews of several variants in one batch.
+     *
+     * Variants with equivalent settings, see @ref PreviewParameters::canonicalKey, are rendered
+     * only once. The others are rendered concurrently and share the font resolution, the shaping
+     * results and the glyphs through the caches of the renderer. The calling thread takes part in
+     * rendering and does not wait for tasks to start, so this may be called from a task of the
+     * same thread pool.
+     * @param variants parameters of the previews
+     * @param requestedSize see @ref getImage
+     * @param token optional, see @ref getImage
+     * @param pool to spread the rendering over
+     * @return previews in the order of the variants, which are null for abandoned renderings
+     */
+    QList<QImage> getImages(const QList<PreviewParameters>& variants,
+                            const QSize& requestedSize = QSize(),
+                            const CancellationToken* token = nullptr,
+                            QThreadPool* pool = QThreadPool::globalInstance());
+
+    /**
+     * @brief spriteSheet arranges previews in a grid of equally sized cells.
+     *
+     * Cells are as large as the largest preview and filled with the background, every preview is
+     * placed at the upper left corner of its cell. Hence the cell of the preview with index i is
+     * found at column i % columns and row i / columns.
+     * @param images previews in device pixels, e.g. from @ref getImages
+     * @param columns of the grid
+     * @return the sprite sheet, which is null if any preview is null
+     */
+    QImage spriteSheet(const QList<QImage>& images, int columns) const;
 };
 
 #endif // MENUPREVIEW_H
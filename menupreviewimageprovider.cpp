@@ -18,18 +18,208 @@
 #include "menupreviewimageprovider.h"
 #include "freetype-renderer.h"
 #include "kxftconfig.h"
+#include "trace.h"
 
-MenuPreviewImageProvider::MenuPreviewImageProvider()
+#include <QIcon>
+#include <QStringList>
+
+namespace
+{
+
+/**
+ * Parse the id of a sprite sheet, see AsyncMenuPreviewImageProvider::requestImageResponse.
+ * @return the variants on the sheet, empty for malformed ids
+ */
+QList<PreviewParameters> parseSheet(const QString& id, int* columns)
+{
+    QList<PreviewParameters> variants;
+    auto fragments = id.split("/");
+    if (fragments.length() < 7) {
+        return variants;
+    }
+    *columns = fragments[1].toInt();
+    if (*columns < 1) {
+        return variants;
+    }
+    const auto& family = fragments[2];
+    const auto& size = fragments[3];
+    const auto& dpi = fragments[4];
+    const auto& devicePixelRatio = fragments[5];
+    for (int i = 6; i < fragments.length(); ++i) {
+        auto settings = fragments[i].split(".");
+        if (settings.length() != 3) {
+            return QList<PreviewParameters>();
+        }
+        QStringList previewId{ family,      size, settings[0], settings[1],
+                               settings[2], dpi,  devicePixelRatio };
+        variants.append(PreviewParameters::fromString(previewId.join("/")));
+    }
+    return variants;
+}
+
+/**
+ * A newer request for the same preview variant, or the same set of variants for sprite sheets,
+ * makes an older rendering obsolete. The resolution and the requested size are part of the key,
+ * so consumers on different screens or of different size do not supersede each other.
+ */
+QString
+generationKey(const QList<PreviewParameters>& variants, int columns, const QSize& requestedSize)
+{
+    const auto& first = variants.first();
+    auto consumer = QString("%1x%2*%3@%4x%5")
+                        .arg(first.options.dpiH)
+                        .arg(first.options.dpiV)
+                        .arg(first.devicePixelRatio)
+                        .arg(requestedSize.width())
+                        .arg(requestedSize.height());
+    if (columns == 0) {
+        return QString("%1/%2").arg(first.variantKey()).arg(consumer);
+    }
+    QStringList keys;
+    for (const auto& variant : variants) {
+        keys.append(variant.variantKey());
+    }
+    return QString("sheet/%1/%2/%3").arg(columns).arg(keys.join(",")).arg(consumer);
+}
+}
+
+/**********************/
+/* ComposedImageCache */
+/**********************/
+
+ComposedImageCache::ComposedImageCache(int maxBytes) : cache(maxBytes), hits(0), misses(0)
+{
+}
+
+QString ComposedImageCache::key(const PreviewParameters& parameters,
+                                const QSize& size,
+                                qreal devicePixelRatio)
+{
+    return QString("%1@%2x%3*%4#%5")
+        .arg(parameters.canonicalKey())
+        .arg(size.width())
+        .arg(size.height())
+        .arg(devicePixelRatio)
+        .arg(QIcon::themeName());
+}
+
+QString ComposedImageCache::sheetKey(const QString& id)
+{
+    return QString("%1#%2").arg(id).arg(QIcon::themeName());
+}
+
+bool ComposedImageCache::find(const QString& key, QImage* image)
+{
+    QMutexLocker locker(&mutex);
+    auto cached = cache.object(key);
+    if (cached == nullptr) {
+        ++misses;
+        return false;
+    }
+    ++hits;
+    *image = *cached;
+    return true;
+}
+
+void ComposedImageCache::insert(const QString& key, const QImage& image)
+{
+    QMutexLocker locker(&mutex);
+    cache.insert(key, new QImage(image), qMax(1, static_cast<int>(image.sizeInBytes())));
+}
+
+bool ComposedImageCache::contains(const QString& key)
+{
+    QMutexLocker locker(&mutex);
+    return cache.contains(key);
+}
+
+quint64 ComposedImageCache::getHits()
+{
+    QMutexLocker locker(&mutex);
+    return hits;
+}
+
+quint64 ComposedImageCache::getMisses()
+{
+    QMutexLocker locker(&mutex);
+    return misses;
+}
+
+double ComposedImageCache::getHitRate()
+{
+    QMutexLocker locker(&mutex);
+    auto lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0;
+}
+
+int ComposedImageCache::getResidentBytes()
+{
+    QMutexLocker locker(&mutex);
+    return cache.totalCost();
+}
+
+/*******************/
+/* RequestRecorder */
+/*******************/
+
+RequestRecorder::RequestRecorder()
+{
+    auto path = QString::fromLocal8Bit(qgetenv("HARFBUZZ_QML_RECORD"));
+    if (!path.isEmpty()) {
+        file.setFileName(path);
+        file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    }
+}
+
+RequestRecorder& RequestRecorder::instance()
+{
+    static RequestRecorder sharedRecorder;
+    return sharedRecorder;
+}
+
+void RequestRecorder::record(const QString& id, const QSize& requestedSize)
+{
+    if (!file.isOpen()) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    if (!clock.isValid()) {
+        clock.start();
+    }
+    file.write(QString("%1 %2 %3 %4\n")
+                   .arg(clock.nsecsElapsed() / 1000)
+                   .arg(requestedSize.width())
+                   .arg(requestedSize.height())
+                   .arg(id)
+                   .toUtf8());
+    // the log stays complete, when the session ends abruptly
+    file.flush();
+}
+
+/****************************/
+/* MenuPreviewImageProvider */
+/****************************/
+
+MenuPreviewImageProvider::MenuPreviewImageProvider(int cacheBytes)
     : QQuickImageProvider(QQuickImageProvider::Image),
-      renderer(Qt::white)
+      renderer(Qt::white),
+      cache(cacheBytes)
 {
 }
 
 QImage
 MenuPreviewImageProvider::requestImage(const QString& id, QSize* size, const QSize& requestedSize)
 {
+    TRACE_SCOPE("requestImage");
+    RequestRecorder::instance().record(id, requestedSize);
     auto parameters = PreviewParameters::fromString(id);
-    auto result = renderer.getImage(parameters);
+    auto key = ComposedImageCache::key(parameters, requestedSize, parameters.devicePixelRatio);
+    QImage result;
+    if (!cache.find(key, &result)) {
+        TRACE_SCOPE("render");
+        result = renderer.getImage(parameters, requestedSize);
+        cache.insert(key, result);
+    }
     size->setHeight(result.height());
     size->setWidth(result.width());
     return result;
@@ -41,3 +231,412 @@ MenuPreviewImageProvider::requestPixmap(const QString& id, QSize* size, const QS
     auto result = this->requestImage(id, size, requestedSize);
     return QPixmap::fromImage(result);
 }
+
+ComposedImageCache& MenuPreviewImageProvider::getCache()
+{
+    return cache;
+}
+
+/****************************/
+/* MenuPreviewImageResponse */
+/****************************/
+
+MenuPreviewImageResponse::MenuPreviewImageResponse(
+    const QSharedPointer<PreviewRendering>& rendering)
+    : rendering(rendering), abandoned(false)
+{
+}
+
+QQuickTextureFactory* MenuPreviewImageResponse::textureFactory() const
+{
+    return QQuickTextureFactory::textureFactoryForImage(image);
+}
+
+QString MenuPreviewImageResponse::errorString() const
+{
+    if (abandoned) {
+        return QStringLiteral("preview rendering abandoned");
+    }
+    return image.isNull() ? QStringLiteral("preview rendering failed") : QString();
+}
+
+bool MenuPreviewImageResponse::isAbandoned() const
+{
+    return abandoned;
+}
+
+void MenuPreviewImageResponse::cancel()
+{
+    // the engine waits for finished in any case, unless the result is already on its way
+    if (!rendering.isNull() && rendering->detach(this)) {
+        abandoned = true;
+        emit finished();
+    }
+}
+
+void MenuPreviewImageResponse::deliver(const QImage& result, bool abandoned)
+{
+    image = result;
+    this->abandoned = abandoned;
+    QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+}
+
+/********************/
+/* PreviewRendering */
+/********************/
+
+PreviewRendering::PreviewRendering(AsyncMenuPreviewImageProvider* provider,
+                                   MenuPreviewRenderer* renderer,
+                                   const QList<PreviewParameters>& variants,
+                                   int columns,
+                                   const QSize& requestedSize,
+                                   const QString& key,
+                                   bool speculative,
+                                   RenderGenerations* generations)
+    : provider(provider)
+    , renderer(renderer)
+    , variants(variants)
+    , columns(columns)
+    , requestedSize(requestedSize)
+    , key(key)
+    , speculative(speculative)
+    , token(generations, generationKey(variants, columns, requestedSize))
+    , done(false)
+{
+    setAutoDelete(false);
+}
+
+QSharedPointer<PreviewRendering>
+PreviewRendering::create(AsyncMenuPreviewImageProvider* provider,
+                         MenuPreviewRenderer* renderer,
+                         const PreviewParameters& parameters,
+                         const QSize& requestedSize,
+                         const QString& key,
+                         RenderGenerations* generations)
+{
+    QSharedPointer<PreviewRendering> rendering(new PreviewRendering(
+        provider, renderer, { parameters }, 0, requestedSize, key, false, generations));
+    rendering->keepAlive = rendering;
+    return rendering;
+}
+
+QSharedPointer<PreviewRendering>
+PreviewRendering::createSheet(AsyncMenuPreviewImageProvider* provider,
+                              MenuPreviewRenderer* renderer,
+                              const QList<PreviewParameters>& variants,
+                              int columns,
+                              const QString& key,
+                              RenderGenerations* generations)
+{
+    QSharedPointer<PreviewRendering> rendering(new PreviewRendering(
+        provider, renderer, variants, columns, QSize(), key, false, generations));
+    rendering->keepAlive = rendering;
+    return rendering;
+}
+
+QSharedPointer<PreviewRendering>
+PreviewRendering::createSpeculative(AsyncMenuPreviewImageProvider* provider,
+                                    MenuPreviewRenderer* renderer,
+                                    const PreviewParameters& parameters,
+                                    const QSize& requestedSize,
+                                    const QString& key)
+{
+    // without generations, so requests of the same variant are not superseded
+    QSharedPointer<PreviewRendering> rendering(new PreviewRendering(
+        provider, renderer, { parameters }, 0, requestedSize, key, true, nullptr));
+    rendering->keepAlive = rendering;
+    return rendering;
+}
+
+bool PreviewRendering::isSpeculative() const
+{
+    return speculative;
+}
+
+void PreviewRendering::preempt()
+{
+    QMutexLocker locker(&mutex);
+    if (responses.isEmpty() && !done) {
+        token.cancel();
+    }
+}
+
+bool PreviewRendering::attach(MenuPreviewImageResponse* response)
+{
+    QMutexLocker locker(&mutex);
+    if (done || token.isObsolete()) {
+        return false;
+    }
+    responses.append(response);
+    return true;
+}
+
+bool PreviewRendering::detach(MenuPreviewImageResponse* response)
+{
+    QMutexLocker locker(&mutex);
+    bool waiting = responses.removeOne(response);
+    if (responses.isEmpty() && !done) {
+        token.cancel();
+    }
+    return waiting;
+}
+
+void PreviewRendering::run()
+{
+    QSharedPointer<PreviewRendering> self;
+    self.swap(keepAlive);
+    TRACE_SCOPE(speculative ? "speculativeRendering" : "rendering");
+
+    QImage image;
+    if (!token.abandon(RenderStage::Queued)) {
+        image = render(&token);
+    }
+    if (image.isNull() && token.isSuperseded() && isAwaited()) {
+        // a request of another consumer superseded the rendering, but these responses are still
+        // waiting, since the engine did not cancel them
+        image = render(nullptr);
+    }
+    provider->finishRendering(key, this, image);
+
+    QMutexLocker locker(&mutex);
+    done = true;
+    for (auto response : responses) {
+        response->deliver(image, image.isNull() && token.isObsolete());
+    }
+    responses.clear();
+}
+
+QImage PreviewRendering::render(const CancellationToken* token)
+{
+    if (columns == 0) {
+        return renderer->getImage(variants.first(), requestedSize, token);
+    }
+    auto images = renderer->getImages(variants, QSize(), token, &provider->pool);
+    provider->cacheVariants(variants, images);
+    return renderer->spriteSheet(images, columns);
+}
+
+bool PreviewRendering::isAwaited()
+{
+    QMutexLocker locker(&mutex);
+    return !responses.isEmpty();
+}
+
+/*********************************/
+/* AsyncMenuPreviewImageProvider */
+/*********************************/
+
+AsyncMenuPreviewImageProvider::AsyncMenuPreviewImageProvider(int maxThreads,
+                                                             int cacheBytes,
+                                                             int speculativeThreads)
+    : renderer(Qt::white)
+    , cache(cacheBytes)
+    , requests(0)
+    , coalescedRequests(0)
+    , requestedRenderings(0)
+    , speculativeRenderings(0)
+    , maxSpeculativeRenderings(qBound(0, speculativeThreads, qMax(1, maxThreads)))
+    , speculativeBytes(0)
+    , maxSpeculativeBytes(cacheBytes / 2)
+    , startedSpeculations(0)
+{
+    pool.setMaxThreadCount(qMax(1, maxThreads));
+    // workers keep their FreeType library with the open faces, see FreeTypeLibrary
+    pool.setExpiryTimeout(-1);
+}
+
+QQuickImageResponse*
+AsyncMenuPreviewImageProvider::requestImageResponse(const QString& id,
+                                                    const QSize& requestedSize)
+{
+    TRACE_SCOPE("requestImageResponse");
+    RequestRecorder::instance().record(id, requestedSize);
+    QList<PreviewParameters> variants;
+    int columns = 0;
+    QString key;
+    if (id.startsWith(QLatin1String("sheet/"))) {
+        variants = parseSheet(id, &columns);
+        key = ComposedImageCache::sheetKey(id);
+    } else {
+        auto parameters = PreviewParameters::fromString(id);
+        key = ComposedImageCache::key(parameters, requestedSize, parameters.devicePixelRatio);
+        variants.append(parameters);
+    }
+
+    QMutexLocker locker(&mutex);
+    ++requests;
+    speculativeBytes = 0;
+    if (variants.isEmpty()) {
+        auto response = new MenuPreviewImageResponse(QSharedPointer<PreviewRendering>());
+        response->deliver(QImage());
+        return response;
+    }
+    if (columns == 0) {
+        speculate(variants.first(), requestedSize);
+    }
+    QImage cached;
+    if (cache.find(key, &cached)) {
+        auto response = new MenuPreviewImageResponse(QSharedPointer<PreviewRendering>());
+        response->deliver(cached);
+        startSpeculation();
+        return response;
+    }
+    auto rendering = inFlight.value(key);
+    if (!rendering.isNull()) {
+        auto response = new MenuPreviewImageResponse(rendering);
+        if (rendering->attach(response)) {
+            ++coalescedRequests;
+            return response;
+        }
+        delete response;
+    }
+
+    if (columns == 0) {
+        rendering = PreviewRendering::create(this, &renderer, variants.first(), requestedSize, key,
+                                             &generations);
+    } else {
+        rendering =
+            PreviewRendering::createSheet(this, &renderer, variants, columns, key, &generations);
+    }
+    auto response = new MenuPreviewImageResponse(rendering);
+    rendering->attach(response);
+    inFlight.insert(key, rendering);
+    ++requestedRenderings;
+    preemptSpeculation();
+    pool.start(rendering.data());
+    return response;
+}
+
+void AsyncMenuPreviewImageProvider::finishRendering(const QString& key,
+                                                    PreviewRendering* rendering,
+                                                    const QImage& image)
+{
+    QMutexLocker locker(&mutex);
+    if (!image.isNull()) {
+        cache.insert(key, image);
+        if (rendering->isSpeculative()) {
+            speculativeBytes += static_cast<int>(image.sizeInBytes());
+        }
+    }
+    // an obsolete rendering may already be replaced by a newer one
+    if (inFlight.value(key).data() == rendering) {
+        inFlight.remove(key);
+    }
+    if (rendering->isSpeculative()) {
+        --speculativeRenderings;
+    } else {
+        --requestedRenderings;
+    }
+    startSpeculation();
+}
+
+void AsyncMenuPreviewImageProvider::cacheVariants(const QList<PreviewParameters>& variants,
+                                                  const QList<QImage>& images)
+{
+    QMutexLocker locker(&mutex);
+    for (int i = 0; i < variants.size() && i < images.size(); ++i) {
+        if (!images.at(i).isNull()) {
+            const auto& variant = variants.at(i);
+            cache.insert(ComposedImageCache::key(variant, QSize(), variant.devicePixelRatio),
+                         images.at(i));
+        }
+    }
+}
+
+void AsyncMenuPreviewImageProvider::speculate(const PreviewParameters& parameters,
+                                              const QSize& requestedSize)
+{
+    if (maxSpeculativeRenderings == 0) {
+        return;
+    }
+    // users mostly step the size by one point, then switch to an adjacent family
+    QList<PreviewParameters> neighbours;
+    neighbours.append(PreviewParameters(parameters.fontFamily, parameters.pointSize + 1,
+                                        parameters.options, parameters.devicePixelRatio));
+    if (parameters.pointSize > 1) {
+        neighbours.append(PreviewParameters(parameters.fontFamily, parameters.pointSize - 1,
+                                            parameters.options, parameters.devicePixelRatio));
+    }
+    const int family = families.indexOf(parameters.fontFamily);
+    if (family >= 0) {
+        for (int adjacent : { family + 1, family - 1 }) {
+            if (adjacent >= 0 && adjacent < families.size()) {
+                neighbours.append(PreviewParameters(families.at(adjacent), parameters.pointSize,
+                                                    parameters.options,
+                                                    parameters.devicePixelRatio));
+            }
+        }
+    }
+
+    // the neighbours of the latest request are the most likely, older ones are dropped at last
+    for (int i = neighbours.size() - 1; i >= 0; --i) {
+        const auto& neighbour = neighbours.at(i);
+        auto key = ComposedImageCache::key(neighbour, requestedSize, neighbour.devicePixelRatio);
+        for (int j = 0; j < speculations.size(); ++j) {
+            if (speculations.at(j).key == key) {
+                speculations.removeAt(j);
+                break;
+            }
+        }
+        speculations.prepend(Speculation{ neighbour, requestedSize, key });
+    }
+    while (speculations.size() > 64) {
+        speculations.removeLast();
+    }
+}
+
+void AsyncMenuPreviewImageProvider::startSpeculation()
+{
+    while (requestedRenderings == 0 && speculativeRenderings < maxSpeculativeRenderings
+           && !speculations.isEmpty() && speculativeBytes < maxSpeculativeBytes) {
+        auto speculation = speculations.takeFirst();
+        if (inFlight.contains(speculation.key) || cache.contains(speculation.key)) {
+            continue;
+        }
+        auto rendering = PreviewRendering::createSpeculative(
+            this, &renderer, speculation.parameters, speculation.requestedSize, speculation.key);
+        inFlight.insert(speculation.key, rendering);
+        ++speculativeRenderings;
+        ++startedSpeculations;
+        // queued requested renderings always run first
+        pool.start(rendering.data(), -1);
+    }
+}
+
+void AsyncMenuPreviewImageProvider::preemptSpeculation()
+{
+    for (const auto& rendering : inFlight) {
+        if (rendering->isSpeculative()) {
+            rendering->preempt();
+        }
+    }
+}
+
+void AsyncMenuPreviewImageProvider::setFamilies(const QStringList& families)
+{
+    QMutexLocker locker(&mutex);
+    this->families = families;
+}
+
+quint64 AsyncMenuPreviewImageProvider::getStartedSpeculations()
+{
+    QMutexLocker locker(&mutex);
+    return startedSpeculations;
+}
+
+quint64 AsyncMenuPreviewImageProvider::getRequests()
+{
+    QMutexLocker locker(&mutex);
+    return requests;
+}
+
+quint64 AsyncMenuPreviewImageProvider::getCoalescedRequests()
+{
+    QMutexLocker locker(&mutex);
+    return coalescedRequests;
+}
+
+ComposedImageCache& AsyncMenuPreviewImageProvider::getCache()
+{
+    return cache;
+}
@@ -20,18 +20,437 @@
 
 #include "menupreview.h"
 
+#include <QCache>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QQuickImageProvider>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+
+/**
+ * @brief The ComposedImageCache class keeps composed previews within a memory budget.
+ *
+ * QML drops images from its pixmap cache, e.g. when previews scroll out of view, and requests
+ * them again later. Those requests are answered without composing the menu mockup again. The
+ * least recently used previews are evicted, once the budget is exceeded.
+ */
+class ComposedImageCache
+{
+private:
+    QMutex mutex;
+    QCache<QString, QImage> cache;
+    quint64 hits;
+    quint64 misses;
+
+public:
+    /**
+     * @param maxBytes memory budget for the image data
+     */
+    explicit ComposedImageCache(int maxBytes = 32 * 1024 * 1024);
+
+    /**
+     * @brief key identifies a preview by its canonical parameters and output geometry.
+     *
+     * The icon theme is part of the key, so previews composed with the icons of a previous theme
+     * are not served anymore, after the theme changed, see @ref IconCache.
+     * @param parameters see @ref PreviewParameters::canonicalKey
+     * @param size requested output size, invalid for the natural size
+     * @param devicePixelRatio of the screen the preview is shown on
+     */
+    static QString key(const PreviewParameters& parameters,
+                       const QSize& size,
+                       qreal devicePixelRatio);
+
+    /**
+     * @brief sheetKey identifies a sprite sheet by its id and the icon theme, see @ref key.
+     */
+    static QString sheetKey(const QString& id);
+
+    /**
+     * @brief find looks up a preview.
+     * @param key see @ref key
+     * @param image receives the cached preview, which is implicitly shared
+     * @return true if the preview was cached
+     */
+    bool find(const QString& key, QImage* image);
+
+    void insert(const QString& key, const QImage& image);
+
+    /**
+     * @return true if the preview is cached, without counting a lookup
+     */
+    bool contains(const QString& key);
+
+    quint64 getHits();
+    quint64 getMisses();
+
+    /**
+     * @return ratio of lookups answered from the cache
+     */
+    double getHitRate();
+
+    /**
+     * @return memory used by the cached image data in bytes
+     */
+    int getResidentBytes();
+};
+
+/**
+ * @brief The RequestRecorder class logs the requests of the image providers, so user sessions
+ * can be replayed by harfbuzz-qml-replay.
+ *
+ * Recording is switched on by setting the environment variable HARFBUZZ_QML_RECORD to the path of
+ * the log file. Every request is written as one line "time width height id", where time is the
+ * offset to the first request in microseconds and width and height are the requested size, which
+ * is -1 x -1 when invalid. The id is the remainder of the line and may contain spaces.
+ */
+class RequestRecorder
+{
+private:
+    QMutex mutex;
+    QFile file;
+    QElapsedTimer clock;
+
+    RequestRecorder();
+
+public:
+    static RequestRecorder& instance();
+
+    /**
+     * @brief record a request, does nothing when recording is off.
+     */
+    void record(const QString& id, const QSize& requestedSize);
+};
 
 class MenuPreviewImageProvider : public QQuickImageProvider
 {
 private:
     MenuPreviewRenderer renderer;
+    ComposedImageCache cache;
 
 public:
-    MenuPreviewImageProvider();
+    /**
+     * @param cacheBytes memory budget for composed previews, see @ref ComposedImageCache
+     */
+    explicit MenuPreviewImageProvider(int cacheBytes = 32 * 1024 * 1024);
 
     QImage requestImage(const QString& id, QSize* size, const QSize& requestedSize) override;
     QPixmap requestPixmap(const QString& id, QSize* size, const QSize& requestedSize) override;
+
+    ComposedImageCache& getCache();
+};
+
+class AsyncMenuPreviewImageProvider;
+class PreviewRendering;
+
+/**
+ * @brief The MenuPreviewImageResponse class is the answer to a single preview request.
+ *
+ * The image is rendered by a @ref PreviewRendering, which may be shared with other responses for
+ * the same preview. The QML engine takes ownership of the response and deletes it after the
+ * finished signal. Responses of abandoned renderings finish without an image.
+ */
+class MenuPreviewImageResponse : public QQuickImageResponse
+{
+private:
+    QSharedPointer<PreviewRendering> rendering;
+    QImage image;
+
+    /**
+     * @brief abandoned is set, when the response was cancelled or its rendering was abandoned.
+     */
+    bool abandoned;
+
+public:
+    explicit MenuPreviewImageResponse(const QSharedPointer<PreviewRendering>& rendering);
+
+    QQuickTextureFactory* textureFactory() const override;
+    QString errorString() const override;
+    void cancel() override;
+
+    /**
+     * @return true, if no image was delivered, because the rendering was abandoned, as opposed
+     * to a failed rendering
+     */
+    bool isAbandoned() const;
+
+    /**
+     * @brief deliver sets the result and emits finished from the event loop, since the engine
+     * is not yet listening while the response is being created and a rendering may finish before
+     * the engine connected to the response.
+     * @param abandoned see @ref isAbandoned
+     */
+    void deliver(const QImage& result, bool abandoned = false);
+};
+
+/**
+ * @brief The PreviewRendering class is a preview rendering in flight as task of a thread pool.
+ *
+ * Concurrent requests for the same preview attach to the rendering and all receive its result.
+ * The rendering is abandoned at the next stage boundary when all attached responses are cancelled
+ * or a newer request for the same preview variant arrived, see @ref CancellationToken. Responses,
+ * which are still waiting for a superseded rendering, receive the image nevertheless.
+ *
+ * A rendering may also produce a sprite sheet of several variants, see
+ * @ref AsyncMenuPreviewImageProvider::requestImageResponse.
+ */
+class PreviewRendering : public QRunnable
+{
+private:
+    AsyncMenuPreviewImageProvider* provider;
+    MenuPreviewRenderer* renderer;
+    const QList<PreviewParameters> variants;
+
+    /**
+     * @brief columns of the sprite sheet, zero for rendering a single preview.
+     */
+    const int columns;
+    const QSize requestedSize;
+    const QString key;
+
+    /**
+     * @brief speculative renderings were not requested yet, see
+     * @ref AsyncMenuPreviewImageProvider::setFamilies.
+     */
+    const bool speculative;
+    CancellationToken token;
+
+    QMutex mutex;
+    QList<MenuPreviewImageResponse*> responses;
+    bool done;
+
+    /**
+     * @brief keepAlive holds the rendering until it ran, the thread pool does not own it.
+     */
+    QSharedPointer<PreviewRendering> keepAlive;
+
+    /**
+     * @brief render the preview or the sprite sheet.
+     * @param token optional, see @ref MenuPreviewRenderer::getImage
+     */
+    QImage render(const CancellationToken* token);
+
+    /**
+     * @return true, if responses are waiting for the result
+     */
+    bool isAwaited();
+
+    PreviewRendering(AsyncMenuPreviewImageProvider* provider,
+                     MenuPreviewRenderer* renderer,
+                     const QList<PreviewParameters>& variants,
+                     int columns,
+                     const QSize& requestedSize,
+                     const QString& key,
+                     bool speculative,
+                     RenderGenerations* generations);
+
+public:
+    /**
+     * @brief create a rendering, which has to be started on a thread pool.
+     * @param provider is notified when the rendering finished, it has to outlive the rendering
+     * @param renderer has to outlive the rendering, it is used from the worker thread
+     * @param parameters of the requested preview
+     * @param requestedSize see @ref MenuPreviewRenderer::getImage
+     * @param key see @ref ComposedImageCache::key
+     * @param generations of the provider, see @ref CancellationToken::CancellationToken
+     */
+    static QSharedPointer<PreviewRendering> create(AsyncMenuPreviewImageProvider* provider,
+                                                   MenuPreviewRenderer* renderer,
+                                                   const PreviewParameters& parameters,
+                                                   const QSize& requestedSize,
+                                                   const QString& key,
+                                                   RenderGenerations* generations);
+
+    /**
+     * @brief createSheet a rendering of a sprite sheet, see @ref MenuPreviewRenderer::spriteSheet.
+     * @param variants parameters of the previews on the sheet
+     * @param columns of the sprite sheet
+     * @param key identifies the sprite sheet
+     * @see create for the other parameters
+     */
+    static QSharedPointer<PreviewRendering>
+    createSheet(AsyncMenuPreviewImageProvider* provider,
+                MenuPreviewRenderer* renderer,
+                const QList<PreviewParameters>& variants,
+                int columns,
+                const QString& key,
+                RenderGenerations* generations);
+
+    /**
+     * @brief createSpeculative a rendering of a preview, which is likely to be requested soon.
+     *
+     * Speculative renderings do not supersede requested ones of the same variant and may be
+     * preempted, see @ref preempt.
+     * @see create for the parameters
+     */
+    static QSharedPointer<PreviewRendering>
+    createSpeculative(AsyncMenuPreviewImageProvider* provider,
+                      MenuPreviewRenderer* renderer,
+                      const PreviewParameters& parameters,
+                      const QSize& requestedSize,
+                      const QString& key);
+
+    bool isSpeculative() const;
+
+    /**
+     * @brief preempt cancels the rendering, unless a response is attached meanwhile.
+     */
+    void preempt();
+
+    /**
+     * @brief attach a response, which will receive the result.
+     * @return false, if the rendering already finished or became obsolete
+     */
+    bool attach(MenuPreviewImageResponse* response);
+
+    /**
+     * @brief detach a cancelled response. The rendering gets cancelled with the last response.
+     * @return true, if the response was still waiting for the result
+     */
+    bool detach(MenuPreviewImageResponse* response);
+
+    void run() override;
+};
+
+/**
+ * @brief The AsyncMenuPreviewImageProvider class renders previews on a bounded pool of worker
+ * threads, so the previews are rendered concurrently and the user interface stays responsive.
+ *
+ * Requests are coalesced by @ref ComposedImageCache::key, i.e. a request for a preview, which is
+ * already being rendered, waits for that rendering instead of starting another one. Finished
+ * previews are kept in a @ref ComposedImageCache.
+ *
+ * While no requested preview is being rendered, the neighbours of the recently requested previews
+ * are rendered speculatively into the cache: one point size smaller and larger and the adjacent
+ * families, see @ref setFamilies. Speculative renderings run at low priority on a limited number
+ * of threads. Since the last request, they may fill at most half of the cache, so they never
+ * evict all recently requested previews. A request, which needs a new rendering, preempts all
+ * speculative renderings, which no request is waiting for.
+ */
+class AsyncMenuPreviewImageProvider : public QQuickAsyncImageProvider
+{
+private:
+    MenuPreviewRenderer renderer;
+    RenderGenerations generations;
+    ComposedImageCache cache;
+
+    QMutex mutex;
+    QHash<QString, QSharedPointer<PreviewRendering>> inFlight;
+    quint64 requests;
+    quint64 coalescedRequests;
+
+    /**
+     * @brief The Speculation struct is a preview, which is likely to be requested soon.
+     */
+    struct Speculation
+    {
+        PreviewParameters parameters;
+        QSize requestedSize;
+        QString key;
+    };
+
+    /**
+     * @brief speculations are pending, the most likely first.
+     */
+    QList<Speculation> speculations;
+    QStringList families;
+    int requestedRenderings;
+    int speculativeRenderings;
+    const int maxSpeculativeRenderings;
+
+    /**
+     * @brief speculativeBytes of the previews rendered speculatively since the last request.
+     */
+    int speculativeBytes;
+    const int maxSpeculativeBytes;
+    quint64 startedSpeculations;
+
+    /**
+     * @brief pool is declared after the other members, so it is destroyed first and waits for all
+     * pending renderings.
+     */
+    QThreadPool pool;
+
+    friend class PreviewRendering;
+
+    /**
+     * @brief finishRendering stops coalescing requests into the given rendering and caches the
+     * result.
+     */
+    void finishRendering(const QString& key, PreviewRendering* rendering, const QImage& image);
+
+    /**
+     * @brief cacheVariants caches the previews of a sprite sheet, so subsequent requests for
+     * single previews are answered from the cache.
+     */
+    void cacheVariants(const QList<PreviewParameters>& variants, const QList<QImage>& images);
+
+    /**
+     * @brief speculate queues the neighbours of a requested preview for speculative rendering.
+     */
+    void speculate(const PreviewParameters& parameters, const QSize& requestedSize);
+
+    /**
+     * @brief startSpeculation starts pending speculations as far as the budgets allow.
+     */
+    void startSpeculation();
+
+    /**
+     * @brief preemptSpeculation cancels the speculative renderings, nobody is waiting for.
+     */
+    void preemptSpeculation();
+
+public:
+    /**
+     * @param maxThreads number of worker threads, by default the number of cores
+     * @param cacheBytes memory budget for composed previews, see @ref ComposedImageCache
+     * @param speculativeThreads number of worker threads for speculative renderings at most,
+     *        zero disables speculation
+     */
+    explicit AsyncMenuPreviewImageProvider(int maxThreads = QThread::idealThreadCount(),
+                                           int cacheBytes = 32 * 1024 * 1024,
+                                           int speculativeThreads = 1);
+
+    /**
+     * @brief requestImageResponse renders a single preview or a sprite sheet of previews.
+     *
+     * Ids of single previews are parsed by @ref PreviewParameters::fromString. Ids of the form
+     * sheet/columns/family/size/dpi/devicePixelRatio/variant[/variant...], where a variant is
+     * antialiasing.hintstyle.subpixel, request a sprite sheet of all variants in one batch, see
+     * @ref MenuPreviewRenderer::getImages. The previews of a sheet are cached individually as
+     * well. The requested size is ignored for sprite sheets.
+     */
+    QQuickImageResponse* requestImageResponse(const QString& id,
+                                              const QSize& requestedSize) override;
+
+    /**
+     * @return number of requested images
+     */
+    quint64 getRequests();
+
+    /**
+     * @return number of requests, which were served by a rendering already in flight
+     */
+    quint64 getCoalescedRequests();
+
+    /**
+     * @brief setFamilies sets the font families in the order, in which the user steps through.
+     *
+     * The adjacent families of a requested preview are rendered speculatively.
+     */
+    void setFamilies(const QStringList& families);
+
+    /**
+     * @return number of started speculative renderings
+     */
+    quint64 getStartedSpeculations();
+
+    ComposedImageCache& getCache();
 };
 
 #endif // RENERPREVIEWIMAGEPROVIDER_H
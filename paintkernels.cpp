@@ -0,0 +1,455 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Glyph paint functions specialized at compile time for glyph layout and canvas format.
+ *
+ * A paint function clips the glyph and hands each row to a row painter. Coverage<layout> hides
+ * how the coverage of a pixel is stored, Pixels<format> how a canvas pixel is accessed. For
+ * QImage::Format_RGB32 and opaque QImage::Format_ARGB32_Premultiplied whole rows are passed on to
+ * the scanline kernels instead.
+ */
+
+#include "paintkernels.h"
+
+#include <QRect>
+
+namespace
+{
+
+/************/
+/* Coverage */
+/************/
+
+template <GlyphLayout layout>
+struct Coverage;
+
+template <>
+struct Coverage<GlyphLayout::Monochrome>
+{
+    static const unsigned char* row(const GlyphRaster& raster, int y)
+    {
+        return raster.buffer + y * raster.pitch;
+    }
+
+    static void get(const unsigned char* row, int, int x, int* red, int* green, int* blue)
+    {
+        *red = *green = *blue = (row[x / 8] >> (7 - x % 8) & 0x1) ? 255 : 0;
+    }
+};
+
+template <>
+struct Coverage<GlyphLayout::GrayScale>
+{
+    static const unsigned char* row(const GlyphRaster& raster, int y)
+    {
+        return raster.buffer + y * raster.pitch;
+    }
+
+    static void get(const unsigned char* row, int, int x, int* red, int* green, int* blue)
+    {
+        *red = *green = *blue = row[x];
+    }
+};
+
+template <bool reversed>
+struct HorizontalCoverage
+{
+    static const unsigned char* row(const GlyphRaster& raster, int y)
+    {
+        return raster.buffer + y * raster.pitch;
+    }
+
+    static void get(const unsigned char* row, int, int x, int* red, int* green, int* blue)
+    {
+        *red = row[3 * x + (reversed ? 2 : 0)];
+        *green = row[3 * x + 1];
+        *blue = row[3 * x + (reversed ? 0 : 2)];
+    }
+};
+
+template <>
+struct Coverage<GlyphLayout::Rgb> : HorizontalCoverage<false>
+{
+};
+
+template <>
+struct Coverage<GlyphLayout::Bgr> : HorizontalCoverage<true>
+{
+};
+
+template <bool reversed>
+struct VerticalCoverage
+{
+    static const unsigned char* row(const GlyphRaster& raster, int y)
+    {
+        return raster.buffer + 3 * y * raster.pitch;
+    }
+
+    static void get(const unsigned char* row, int pitch, int x, int* red, int* green, int* blue)
+    {
+        *red = row[x + (reversed ? 2 : 0) * pitch];
+        *green = row[x + pitch];
+        *blue = row[x + (reversed ? 0 : 2) * pitch];
+    }
+};
+
+template <>
+struct Coverage<GlyphLayout::VerticalRgb> : VerticalCoverage<false>
+{
+};
+
+template <>
+struct Coverage<GlyphLayout::VerticalBgr> : VerticalCoverage<true>
+{
+};
+
+/************/
+/* Scanline */
+/************/
+
+/**
+ * Hand a row of a glyph to the scanline kernel of its layout.
+ */
+template <GlyphLayout layout>
+struct Scanline;
+
+template <>
+struct Scanline<GlyphLayout::Monochrome>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        kernels.monochromeScanline(target, row, left, count, pen);
+    }
+};
+
+template <>
+struct Scanline<GlyphLayout::GrayScale>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        kernels.grayScanline(target, row + left, count, pen);
+    }
+};
+
+template <>
+struct Scanline<GlyphLayout::Rgb>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        kernels.rgbScanline(target, row + 3 * left, count, pen);
+    }
+};
+
+template <>
+struct Scanline<GlyphLayout::Bgr>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        kernels.bgrScanline(target, row + 3 * left, count, pen);
+    }
+};
+
+template <>
+struct Scanline<GlyphLayout::VerticalRgb>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int pitch,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        const unsigned char* top = row + left;
+        kernels.verticalScanline(target, top, top + pitch, top + 2 * pitch, count, pen);
+    }
+};
+
+template <>
+struct Scanline<GlyphLayout::VerticalBgr>
+{
+    static void paint(const BlendKernels& kernels,
+                      quint32* target,
+                      const unsigned char* row,
+                      int pitch,
+                      int left,
+                      int count,
+                      quint32 pen)
+    {
+        const unsigned char* top = row + left;
+        kernels.verticalScanline(target, top + 2 * pitch, top + pitch, top, count, pen);
+    }
+};
+
+/**********/
+/* Pixels */
+/**********/
+
+/**
+ * Access to the pixels of a canvas row, QImage::Format_Invalid stands for any format.
+ */
+template <QImage::Format format>
+class Pixels
+{
+private:
+    QImage* canvas;
+    int y;
+
+public:
+    Pixels(QImage* canvas, int y) : canvas(canvas), y(y)
+    {
+    }
+
+    void get(int x, int* red, int* green, int* blue) const
+    {
+        QRgb pixel = canvas->pixel(x, y);
+        *red = qRed(pixel);
+        *green = qGreen(pixel);
+        *blue = qBlue(pixel);
+    }
+
+    void set(int x, int red, int green, int blue)
+    {
+        canvas->setPixel(x, y, qRgb(red, green, blue));
+    }
+};
+
+template <>
+class Pixels<QImage::Format_RGB888>
+{
+private:
+    uchar* line;
+
+public:
+    Pixels(QImage* canvas, int y) : line(canvas->scanLine(y))
+    {
+    }
+
+    void get(int x, int* red, int* green, int* blue) const
+    {
+        *red = line[3 * x];
+        *green = line[3 * x + 1];
+        *blue = line[3 * x + 2];
+    }
+
+    void set(int x, int red, int green, int blue)
+    {
+        line[3 * x] = static_cast<uchar>(red);
+        line[3 * x + 1] = static_cast<uchar>(green);
+        line[3 * x + 2] = static_cast<uchar>(blue);
+    }
+};
+
+template <>
+class Pixels<QImage::Format_Grayscale8>
+{
+private:
+    uchar* line;
+
+public:
+    Pixels(QImage* canvas, int y) : line(canvas->scanLine(y))
+    {
+    }
+
+    void get(int x, int* red, int* green, int* blue) const
+    {
+        *red = *green = *blue = line[x];
+    }
+
+    void set(int x, int red, int green, int blue)
+    {
+        line[x] = static_cast<uchar>((red + green + blue) / 3);
+    }
+};
+
+/**************/
+/* RowPainter */
+/**************/
+
+inline int blendChannel(int background, int pen, int coverage)
+{
+    return ((255 - coverage) * background + coverage * pen) / 255;
+}
+
+/**
+ * Blend a row of a glyph pixel by pixel.
+ */
+template <GlyphLayout layout, QImage::Format format>
+struct RowPainter
+{
+    static void paint(const GlyphPainter::Context& context,
+                      const unsigned char* row,
+                      int pitch,
+                      int left,
+                      int count,
+                      int x,
+                      int y)
+    {
+        Pixels<format> pixels(context.canvas, y);
+        const int penRed = qRed(context.pen);
+        const int penGreen = qGreen(context.pen);
+        const int penBlue = qBlue(context.pen);
+        for (int i = left; i < left + count; ++i) {
+            int red, green, blue;
+            Coverage<layout>::get(row, pitch, i, &red, &green, &blue);
+            if ((red | green | blue) == 0) {
+                continue;
+            }
+            int backgroundRed, backgroundGreen, backgroundBlue;
+            pixels.get(x + i, &backgroundRed, &backgroundGreen, &backgroundBlue);
+            pixels.set(x + i, blendChannel(backgroundRed, penRed, red),
+                       blendChannel(backgroundGreen, penGreen, green),
+                       blendChannel(backgroundBlue, penBlue, blue));
+        }
+    }
+};
+
+template <GlyphLayout layout>
+struct RowPainter<layout, QImage::Format_RGB32>
+{
+    static void paint(const GlyphPainter::Context& context,
+                      const unsigned char* row,
+                      int pitch,
+                      int left,
+                      int count,
+                      int x,
+                      int y)
+    {
+        auto target = reinterpret_cast<quint32*>(context.canvas->scanLine(y)) + x + left;
+        Scanline<layout>::paint(*context.kernels, target, row, pitch, left, count, context.pen);
+    }
+};
+
+template <GlyphLayout layout>
+struct RowPainter<layout, QImage::Format_ARGB32_Premultiplied>
+    : RowPainter<layout, QImage::Format_RGB32>
+{
+};
+
+/******************/
+/* PaintFunctions */
+/******************/
+
+template <GlyphLayout layout, QImage::Format format>
+void paintGlyph(const GlyphPainter::Context& context, const GlyphRaster& raster, int x, int y)
+{
+    QRect glyphArea(x, y, raster.width, raster.height);
+    QRect visible = glyphArea.intersected(context.canvas->rect()).translated(-x, -y);
+    for (int j = visible.top(); j <= visible.bottom(); ++j) {
+        RowPainter<layout, format>::paint(context, Coverage<layout>::row(raster, j),
+                                          raster.pitch, visible.left(), visible.width(), x,
+                                          y + j);
+    }
+}
+
+/**
+ * Paint functions of a canvas format, indexed by GlyphLayout.
+ */
+template <QImage::Format format>
+struct PaintFunctions
+{
+    static const GlyphPainter::PaintFunction table[];
+};
+
+template <QImage::Format format>
+const GlyphPainter::PaintFunction PaintFunctions<format>::table[] = {
+    &paintGlyph<GlyphLayout::Monochrome, format>, &paintGlyph<GlyphLayout::GrayScale, format>,
+    &paintGlyph<GlyphLayout::Rgb, format>,        &paintGlyph<GlyphLayout::Bgr, format>,
+    &paintGlyph<GlyphLayout::VerticalRgb, format>, &paintGlyph<GlyphLayout::VerticalBgr, format>
+};
+
+} // namespace
+
+/****************/
+/* GlyphPainter */
+/****************/
+
+GlyphPainter::GlyphPainter(QImage* canvas, const QColor& pen)
+    : context{ canvas, pen.rgb(), &blendKernels() }
+{
+    switch (canvas->format()) {
+    case QImage::Format_RGB32:
+        functions = PaintFunctions<QImage::Format_RGB32>::table;
+        break;
+    case QImage::Format_ARGB32_Premultiplied:
+        functions = PaintFunctions<QImage::Format_ARGB32_Premultiplied>::table;
+        break;
+    case QImage::Format_RGB888:
+        functions = PaintFunctions<QImage::Format_RGB888>::table;
+        break;
+    case QImage::Format_Grayscale8:
+        functions = PaintFunctions<QImage::Format_Grayscale8>::table;
+        break;
+    default:
+        functions = PaintFunctions<QImage::Format_Invalid>::table;
+        break;
+    }
+}
+
+bool GlyphPainter::layout(FT_Pixel_Mode pixelMode, bool reversed, GlyphLayout* layout)
+{
+    switch (pixelMode) {
+    case FT_PIXEL_MODE_MONO:
+        *layout = GlyphLayout::Monochrome;
+        return true;
+    case FT_PIXEL_MODE_GRAY:
+        *layout = GlyphLayout::GrayScale;
+        return true;
+    case FT_PIXEL_MODE_LCD:
+        *layout = reversed ? GlyphLayout::Bgr : GlyphLayout::Rgb;
+        return true;
+    case FT_PIXEL_MODE_LCD_V:
+        *layout = reversed ? GlyphLayout::VerticalBgr : GlyphLayout::VerticalRgb;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void GlyphPainter::paint(
+    FT_Pixel_Mode pixelMode, bool reversed, const GlyphRaster& raster, int x, int y) const
+{
+    GlyphLayout glyphLayout;
+    if (layout(pixelMode, reversed, &glyphLayout)) {
+        paint(glyphLayout, raster, x, y);
+    }
+}
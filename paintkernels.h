@@ -0,0 +1,121 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAINTKERNELS_H
+#define PAINTKERNELS_H
+
+#include "blendkernels.h"
+
+extern "C" {
+#include <ft2build.h>
+#include FT_FREETYPE_H
+}
+
+#include <QColor>
+#include <QImage>
+
+/**
+ * @brief The GlyphRaster struct describes the coverage data of a rendered glyph.
+ *
+ * Rows are stored top down. For horizontal sub-pixel rendering one pixel takes three consecutive
+ * bytes of a row, for vertical sub-pixel rendering one pixel row takes three consecutive rows.
+ */
+struct GlyphRaster
+{
+    const unsigned char* buffer;
+    int pitch;
+
+    /**
+     * @brief width and height of the glyph in pixels, not in sub-pixels.
+     */
+    int width;
+    int height;
+};
+
+/**
+ * @brief The GlyphLayout enum lists the combinations of FreeType pixel mode and sub-pixel order.
+ */
+enum class GlyphLayout { Monochrome, GrayScale, Rgb, Bgr, VerticalRgb, VerticalBgr };
+
+/**
+ * @brief The GlyphPainter class paints glyphs of any layout onto one canvas with one pen.
+ *
+ * For every combination of glyph layout and canvas format there is a paint function instantiated
+ * at compile time. The functions for the format of the canvas are selected once on construction,
+ * so painting a run of glyphs does not dispatch per glyph on the format nor per pixel on the
+ * layout. Canvases in QImage::Format_RGB32 are painted with the kernels from blendkernels.h,
+ * QImage::Format_RGB888 and QImage::Format_Grayscale8 are accessed directly and all other formats
+ * go through QImage::pixel. Gray scale canvases are meant for coverage masks of gray scale glyphs.
+ *
+ * Canvases in QImage::Format_ARGB32_Premultiplied are painted with the kernels as well, which
+ * keep the alpha channel. This is exact for opaque pixels, i.e. the canvas is expected to be
+ * filled with an opaque background, where glyphs are painted.
+ */
+class GlyphPainter
+{
+public:
+    /**
+     * @brief The Context struct holds everything a paint function needs besides the glyph.
+     */
+    struct Context
+    {
+        QImage* canvas;
+        quint32 pen;
+        const BlendKernels* kernels;
+    };
+
+    typedef void (*PaintFunction)(const Context& context,
+                                  const GlyphRaster& raster,
+                                  int x,
+                                  int y);
+
+    /**
+     * @brief GlyphPainter constructor selects the paint functions for the format of the canvas.
+     * @param canvas which must outlive the painter and must not change its format
+     * @param pen color, in which glyphs will be painted
+     */
+    GlyphPainter(QImage* canvas, const QColor& pen);
+
+    /**
+     * @brief layout maps a FreeType pixel mode and sub-pixel order to a glyph layout.
+     * @param pixelMode of the rendered glyph
+     * @param reversed true for bgr and vbgr sub-pixel order
+     * @param layout receives the glyph layout
+     * @return false for unsupported pixel modes
+     */
+    static bool layout(FT_Pixel_Mode pixelMode, bool reversed, GlyphLayout* layout);
+
+    /**
+     * @brief paint the glyph with its upper left corner at (x,y), clipped to the canvas.
+     */
+    void paint(GlyphLayout layout, const GlyphRaster& raster, int x, int y) const
+    {
+        functions[static_cast<int>(layout)](context, raster, x, y);
+    }
+
+    /**
+     * @brief paint convenience overload for glyphs described by FreeType pixel modes.
+     */
+    void
+    paint(FT_Pixel_Mode pixelMode, bool reversed, const GlyphRaster& raster, int x, int y) const;
+
+private:
+    Context context;
+    const PaintFunction* functions;
+};
+
+#endif // PAINTKERNELS_H
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Load generator replaying recorded image provider requests.
+ *
+ * Reads a request log written by RequestRecorder, see HARFBUZZ_QML_RECORD, and issues the same
+ * requests to a MenuPreviewImageProvider or an AsyncMenuPreviewImageProvider, either at the
+ * recorded pace, scaled by a speed factor, or as fast as possible. Finally the latency
+ * distribution of the requests and the behaviour of the caches are reported on stdout.
+ *
+ * Latencies of the asynchronous provider are measured until the response finished, including
+ * the delivery through the event loop, as seen by the QML engine.
+ */
+
+#include "freetype-renderer.h"
+#include "menupreviewimageprovider.h"
+
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+
+/** latencies of requests, which got no image */
+const qint64 FAILED = -1;
+const qint64 ABANDONED = -2;
+
+struct RecordedRequest
+{
+    /**
+     * @brief time offset to the first request in microseconds.
+     */
+    qint64 time;
+    QSize requestedSize;
+    QString id;
+};
+
+/**
+ * Parse a request log, see RequestRecorder. Empty lines, lines starting with # and malformed
+ * lines are skipped.
+ */
+QVector<RecordedRequest> readLog(QFile* input)
+{
+    QVector<RecordedRequest> requests;
+    QTextStream stream(input);
+    while (!stream.atEnd()) {
+        auto line = stream.readLine();
+        if (line.trimmed().isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+        auto fields = line.split(' ');
+        if (fields.size() < 4) {
+            continue;
+        }
+        bool valid = true;
+        RecordedRequest request;
+        request.time = fields.at(0).toLongLong(&valid);
+        request.requestedSize = QSize(fields.at(1).toInt(), fields.at(2).toInt());
+        // the id may contain spaces
+        request.id = line.section(' ', 3);
+        if (valid) {
+            requests.append(request);
+        }
+    }
+    return requests;
+}
+
+double percentile(const QVector<qint64>& sorted, double fraction)
+{
+    if (sorted.isEmpty()) {
+        return 0;
+    }
+    auto rank = static_cast<int>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted.at(rank) / 1e6;
+}
+
+void reportCache(QTextStream& out, const char* name, quint64 hits, quint64 misses)
+{
+    auto lookups = hits + misses;
+    out << name << ": " << hits << " hits, " << misses << " misses, hit rate "
+        << (lookups ? 100.0 * hits / lookups : 0) << " %\n";
+}
+
+/**
+ * Replay the requests on the calling thread, one after the other.
+ * @param speed factor of the recorded pace, zero for as fast as possible
+ * @param latencies receives the latency of each request in nanoseconds, FAILED or ABANDONED
+ */
+void replaySynchronous(MenuPreviewImageProvider* provider,
+                       const QVector<RecordedRequest>& requests,
+                       double speed,
+                       QVector<qint64>* latencies)
+{
+    QElapsedTimer clock;
+    clock.start();
+    for (int i = 0; i < requests.size(); ++i) {
+        const auto& request = requests.at(i);
+        if (speed > 0) {
+            auto due = static_cast<qint64>(request.time / speed);
+            auto now = clock.nsecsElapsed() / 1000;
+            if (due > now) {
+                QThread::usleep(static_cast<unsigned long>(due - now));
+            }
+        }
+        QElapsedTimer timer;
+        timer.start();
+        QSize size;
+        auto image = provider->requestImage(request.id, &size, request.requestedSize);
+        (*latencies)[i] = image.isNull() ? FAILED : timer.nsecsElapsed();
+    }
+}
+
+/**
+ * Replay the requests from the event loop, without waiting for responses. Returns, when all
+ * responses finished.
+ * @see replaySynchronous for the parameters
+ */
+void replayAsynchronous(AsyncMenuPreviewImageProvider* provider,
+                        const QVector<RecordedRequest>& requests,
+                        double speed,
+                        QVector<qint64>* latencies)
+{
+    QElapsedTimer clock;
+    clock.start();
+    int next = 0;
+    int finished = 0;
+
+    auto issue = [&](int index) {
+        const auto& request = requests.at(index);
+        auto begin = clock.nsecsElapsed();
+        // the provider answers with its own responses
+        auto response = static_cast<MenuPreviewImageResponse*>(
+            provider->requestImageResponse(request.id, request.requestedSize));
+        QObject::connect(response, &QQuickImageResponse::finished, qApp,
+                         [&, index, begin, response]() {
+                             auto latency = clock.nsecsElapsed() - begin;
+                             if (response->isAbandoned()) {
+                                 latency = ABANDONED;
+                             } else if (!response->errorString().isEmpty()) {
+                                 latency = FAILED;
+                             }
+                             (*latencies)[index] = latency;
+                             response->deleteLater();
+                             if (++finished == requests.size()) {
+                                 qApp->quit();
+                             }
+                         });
+    };
+
+    std::function<void()> dispatch = [&]() {
+        auto now = clock.nsecsElapsed() / 1000;
+        while (next < requests.size()
+               && (speed <= 0 || static_cast<qint64>(requests.at(next).time / speed) <= now)) {
+            issue(next++);
+        }
+        if (next < requests.size()) {
+            auto due = static_cast<qint64>(requests.at(next).time / speed);
+            QTimer::singleShot(static_cast<int>((due - now) / 1000), dispatch);
+        }
+    };
+
+    if (requests.isEmpty()) {
+        return;
+    }
+    QTimer::singleShot(0, dispatch);
+    qApp->exec();
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // icons are rasterized without a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replay recorded preview requests.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("log", "Request log, see HARFBUZZ_QML_RECORD, stdin if omitted.");
+    QCommandLineOption speedOption("speed",
+                                   "Factor of the recorded pace, 0 replays as fast as possible.",
+                                   "factor", "1");
+    QCommandLineOption syncOption("sync", "Use the synchronous provider on the main thread.");
+    QCommandLineOption threadsOption("threads", "Number of render threads of the async provider.",
+                                     "count", QString::number(QThread::idealThreadCount()));
+    QCommandLineOption speculativeOption("speculative-threads",
+                                         "Number of threads for speculative renderings.", "count",
+                                         "1");
+    QCommandLineOption cacheOption("cache", "Budget of the composed image cache in MiB.", "MiB",
+                                   "32");
+    parser.addOptions({ speedOption, syncOption, threadsOption, speculativeOption, cacheOption });
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    QFile input;
+    if (parser.positionalArguments().isEmpty() || parser.positionalArguments().first() == "-") {
+        input.open(stdin, QIODevice::ReadOnly);
+    } else {
+        input.setFileName(parser.positionalArguments().first());
+        if (!input.open(QIODevice::ReadOnly)) {
+            err << "cannot read " << input.fileName() << "\n";
+            return 1;
+        }
+    }
+    auto requests = readLog(&input);
+    auto speed = qMax(0.0, parser.value(speedOption).toDouble());
+    auto cacheBytes = parser.value(cacheOption).toInt() * 1024 * 1024;
+
+    QVector<qint64> latencies(requests.size(), FAILED);
+    QElapsedTimer timer;
+    qint64 elapsed;
+    ComposedImageCache* cache;
+    MenuPreviewImageProvider syncProvider(cacheBytes);
+    AsyncMenuPreviewImageProvider asyncProvider(parser.value(threadsOption).toInt(), cacheBytes,
+                                                parser.value(speculativeOption).toInt());
+    if (parser.isSet(syncOption)) {
+        timer.start();
+        replaySynchronous(&syncProvider, requests, speed, &latencies);
+        elapsed = timer.nsecsElapsed();
+        cache = &syncProvider.getCache();
+    } else {
+        timer.start();
+        replayAsynchronous(&asyncProvider, requests, speed, &latencies);
+        elapsed = timer.nsecsElapsed();
+        cache = &asyncProvider.getCache();
+    }
+
+    QVector<qint64> sorted;
+    int failed = 0;
+    int abandoned = 0;
+    for (auto latency : latencies) {
+        if (latency == FAILED) {
+            ++failed;
+        } else if (latency == ABANDONED) {
+            ++abandoned;
+        } else {
+            sorted.append(latency);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    // abandoned renderings are intended behaviour, they do not count as failures
+    out << "requests: " << requests.size() << " replayed, " << abandoned << " abandoned, "
+        << failed << " failed in " << elapsed / 1e9 << " s\n";
+    out << "throughput: " << sorted.size() * 1e9 / qMax(1ll, elapsed) << " images/s\n";
+    out << "latency of delivered images: p50 " << percentile(sorted, 0.5) << " ms, p90 "
+        << percentile(sorted, 0.9) << " ms, p99 " << percentile(sorted, 0.99) << " ms, max "
+        << percentile(sorted, 1) << " ms\n";
+    reportCache(out, "composed images", cache->getHits(), cache->getMisses());
+    out << "composed images resident: " << cache->getResidentBytes() / 1024 << " KiB\n";
+    if (!parser.isSet(syncOption)) {
+        out << "coalesced requests: " << asyncProvider.getCoalescedRequests() << "\n";
+        out << "speculative renderings: " << asyncProvider.getStartedSpeculations() << "\n";
+    }
+    auto& masks = CoverageMaskCache::instance();
+    reportCache(out, "coverage masks", masks.getHits(), masks.getMisses());
+    auto& icons = IconCache::instance();
+    reportCache(out, "icons", icons.getHits(), icons.getMisses());
+    auto& shapedRuns = ShapedRunCache::instance();
+    reportCache(out, "shaped runs", shapedRuns.getHits(), shapedRuns.getMisses());
+    auto& glyphs = GlyphCache::instance();
+    reportCache(out, "glyphs", glyphs.getHits(), glyphs.getMisses());
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Checks every supported instruction set of the blend kernels against the per pixel blending,
+ * which the glyph classes used before the kernels, i.e. QImage::pixelColor and QImage::setPixel
+ * with ((255 - coverage) * background + coverage * pen) / 255 for every channel. The results
+ * have to be bit-exact for random coverage rows, pen colors, backgrounds, lengths and offsets.
+ */
+
+#include "blendkernels.h"
+
+#include <QColor>
+#include <QImage>
+#include <QTextStream>
+#include <QVector>
+
+#include <random>
+
+namespace
+{
+
+const int ROUNDS = 2000;
+const int MAX_COUNT = 100;
+
+/** offset of the first blended pixel, so the kernels also run on unaligned rows */
+const int MAX_OFFSET = 7;
+
+/** mismatches beyond are only counted */
+const int MAX_REPORTED = 20;
+
+std::mt19937 generator(2018);
+
+int randomInt(int max)
+{
+    return std::uniform_int_distribution<int>(0, max)(generator);
+}
+
+/**
+ * Coverage values with many fully covered and uncovered pixels, as found in glyphs.
+ */
+QVector<unsigned char> randomCoverage(int count)
+{
+    QVector<unsigned char> coverage(count);
+    for (auto& value : coverage) {
+        auto kind = randomInt(3);
+        value = kind == 0 ? 0 : kind == 1 ? 255 : static_cast<unsigned char>(randomInt(255));
+    }
+    return coverage;
+}
+
+QColor randomColor()
+{
+    return QColor(randomInt(255), randomInt(255), randomInt(255));
+}
+
+QImage randomRow(int width)
+{
+    QImage row(width, 1, QImage::Format_RGB32);
+    for (int x = 0; x < width; ++x) {
+        row.setPixel(x, 0, randomColor().rgb());
+    }
+    return row;
+}
+
+quint32* pixels(QImage* row, int offset)
+{
+    return reinterpret_cast<quint32*>(row->scanLine(0)) + offset;
+}
+
+/**
+ * The blending of a single pixel as done by GrayScaleGlyph::paint and
+ * AbstractSubPixelGlyph::paint before the kernels.
+ */
+void referenceBlend(QImage* canvas, int x, const QColor& pen, int valueR, int valueG, int valueB)
+{
+    int pen_r, pen_g, pen_b;
+    pen.getRgb(&pen_r, &pen_g, &pen_b);
+    int backgound_r, backgound_g, backgound_b;
+    canvas->pixelColor(x, 0).getRgb(&backgound_r, &backgound_g, &backgound_b);
+    int result_r = ((255 - valueR) * backgound_r + valueR * pen_r) / 255;
+    int result_g = ((255 - valueG) * backgound_g + valueG * pen_g) / 255;
+    int result_b = ((255 - valueB) * backgound_b + valueB * pen_b) / 255;
+    canvas->setPixel(x, 0, qRgb(result_r, result_g, result_b));
+}
+
+class Check
+{
+private:
+    QTextStream err;
+    int failures;
+
+public:
+    Check() : err(stderr), failures(0)
+    {
+    }
+
+    void compare(const char* kernel,
+                 BlendInstructionSet instructionSet,
+                 const QImage& actual,
+                 const QImage& expected)
+    {
+        for (int x = 0; x < actual.width(); ++x) {
+            if (actual.pixel(x, 0) != expected.pixel(x, 0)) {
+                if (failures < MAX_REPORTED) {
+                    err << kernel << " (instruction set " << static_cast<int>(instructionSet)
+                        << "): pixel " << x << " is " << hex << actual.pixel(x, 0)
+                        << " instead of " << expected.pixel(x, 0) << dec << "\n";
+                }
+                ++failures;
+                return;
+            }
+        }
+    }
+
+    int getFailures() const
+    {
+        return failures;
+    }
+};
+
+void checkGray(Check* check, const BlendKernels& kernels)
+{
+    auto count = randomInt(MAX_COUNT);
+    auto offset = randomInt(MAX_OFFSET);
+    auto coverage = randomCoverage(count);
+    auto pen = randomColor();
+    auto actual = randomRow(offset + count);
+    auto expected = actual.copy();
+
+    kernels.grayScanline(pixels(&actual, offset), coverage.constData(), count, pen.rgb());
+    for (int i = 0; i < count; ++i) {
+        referenceBlend(&expected, offset + i, pen, coverage[i], coverage[i], coverage[i]);
+    }
+    check->compare("gray", kernels.instructionSet, actual, expected);
+}
+
+void checkSubPixel(Check* check, const BlendKernels& kernels, bool reversed)
+{
+    auto count = randomInt(MAX_COUNT);
+    auto offset = randomInt(MAX_OFFSET);
+    auto coverage = randomCoverage(3 * count);
+    auto pen = randomColor();
+    auto actual = randomRow(offset + count);
+    auto expected = actual.copy();
+
+    auto kernel = reversed ? kernels.bgrScanline : kernels.rgbScanline;
+    kernel(pixels(&actual, offset), coverage.constData(), count, pen.rgb());
+    int offsetR = reversed ? 2 : 0;
+    int offsetB = reversed ? 0 : 2;
+    for (int i = 0; i < count; ++i) {
+        referenceBlend(&expected, offset + i, pen, coverage[3 * i + offsetR],
+                       coverage[3 * i + 1], coverage[3 * i + offsetB]);
+    }
+    check->compare(reversed ? "bgr" : "rgb", kernels.instructionSet, actual, expected);
+}
+
+void checkVertical(Check* check, const BlendKernels& kernels)
+{
+    auto count = randomInt(MAX_COUNT);
+    auto offset = randomInt(MAX_OFFSET);
+    auto red = randomCoverage(count);
+    auto green = randomCoverage(count);
+    auto blue = randomCoverage(count);
+    auto pen = randomColor();
+    auto actual = randomRow(offset + count);
+    auto expected = actual.copy();
+
+    kernels.verticalScanline(pixels(&actual, offset), red.constData(), green.constData(),
+                             blue.constData(), count, pen.rgb());
+    for (int i = 0; i < count; ++i) {
+        referenceBlend(&expected, offset + i, pen, red[i], green[i], blue[i]);
+    }
+    check->compare("vertical", kernels.instructionSet, actual, expected);
+}
+
+void checkMonochrome(Check* check, const BlendKernels& kernels)
+{
+    auto count = randomInt(MAX_COUNT);
+    auto offset = randomInt(MAX_OFFSET);
+    auto firstBit = randomInt(7);
+    QVector<unsigned char> bits((firstBit + count + 7) / 8 + 1);
+    for (auto& byte : bits) {
+        byte = static_cast<unsigned char>(randomInt(255));
+    }
+    auto pen = randomColor();
+    auto actual = randomRow(offset + count);
+    auto expected = actual.copy();
+
+    kernels.monochromeScanline(pixels(&actual, offset), bits.constData(), firstBit, count,
+                               pen.rgb());
+    // the painting of MonochromeGlyph::paint before the kernels
+    for (int i = 0; i < count; ++i) {
+        uint bit = static_cast<uint>(firstBit + i);
+        if (bits[bit / 8] >> (7 - bit % 8) & 0x1) {
+            expected.setPixel(offset + i, 0, pen.rgb());
+        }
+    }
+    check->compare("monochrome", kernels.instructionSet, actual, expected);
+}
+
+} // namespace
+
+int main()
+{
+    Check check;
+    QTextStream out(stdout);
+    for (auto instructionSet : { BlendInstructionSet::Scalar, BlendInstructionSet::SSE2,
+                                 BlendInstructionSet::SSSE3, BlendInstructionSet::AVX2 }) {
+        if (!isBlendInstructionSetSupported(instructionSet)) {
+            out << "instruction set " << static_cast<int>(instructionSet) << ": not supported\n";
+            continue;
+        }
+        const auto& kernels = blendKernels(instructionSet);
+        for (int round = 0; round < ROUNDS; ++round) {
+            checkGray(&check, kernels);
+            checkSubPixel(&check, kernels, false);
+            checkSubPixel(&check, kernels, true);
+            checkVertical(&check, kernels);
+            checkMonochrome(&check, kernels);
+        }
+        out << "instruction set " << static_cast<int>(instructionSet) << ": checked\n";
+    }
+    out << check.getFailures() << " failures\n";
+    return check.getFailures() ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QTextStream>
+#include <QThread>
+
+namespace
+{
+static const char* TRACE_VARIABLE = "HARFBUZZ_QML_TRACE";
+
+/** Number of events kept per thread, older events are overwritten */
+static const int EVENTS_PER_THREAD = 16384;
+
+struct TraceEvent
+{
+    const char* name;
+    qint64 begin;
+    qint64 end;
+};
+
+/**
+ * Ring buffer of a thread, which is the only writer. Buffers outlive their threads, so the events
+ * of finished threads are exported as well.
+ */
+struct ThreadBuffer
+{
+    int threadId;
+    QString threadName;
+    QAtomicInteger<quint64> count;
+    TraceEvent events[EVENTS_PER_THREAD];
+};
+
+class TraceRegistry
+{
+public:
+    QMutex mutex;
+    QList<ThreadBuffer*> buffers;
+    QElapsedTimer clock;
+
+    TraceRegistry()
+    {
+        clock.start();
+    }
+
+    ~TraceRegistry()
+    {
+        auto path = QString::fromLocal8Bit(qgetenv(TRACE_VARIABLE));
+        if (!path.isEmpty()) {
+            Trace::exportChromeJson(path);
+        }
+        qDeleteAll(buffers);
+    }
+
+    ThreadBuffer* addThread()
+    {
+        auto buffer = new ThreadBuffer;
+        auto thread = QThread::currentThread();
+        buffer->threadName = thread ? thread->objectName() : QString();
+        buffer->count.storeRelease(0);
+        QMutexLocker locker(&mutex);
+        buffer->threadId = buffers.size() + 1;
+        if (buffer->threadName.isEmpty()) {
+            buffer->threadName = QString("thread %1").arg(buffer->threadId);
+        }
+        buffers.append(buffer);
+        return buffer;
+    }
+};
+
+TraceRegistry& registry()
+{
+    static TraceRegistry sharedRegistry;
+    return sharedRegistry;
+}
+
+/**
+ * Format nanoseconds as microseconds with three decimals. Unlike streaming a double, this keeps
+ * nanosecond resolution for traces of any length, so nested events stay within their parents.
+ */
+QString microseconds(qint64 nanoseconds)
+{
+    return QString("%1.%2").arg(nanoseconds / 1000).arg(nanoseconds % 1000, 3, 10, QChar('0'));
+}
+}
+
+/*********/
+/* Trace */
+/*********/
+
+const bool Trace::enabled = !qEnvironmentVariableIsEmpty(TRACE_VARIABLE);
+
+qint64 Trace::now()
+{
+    return registry().clock.nsecsElapsed();
+}
+
+void Trace::record(const char* name, qint64 begin, qint64 end)
+{
+    static thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        buffer = registry().addThread();
+    }
+    auto count = buffer->count.loadAcquire();
+    buffer->events[count % EVENTS_PER_THREAD] = TraceEvent{ name, begin, end };
+    buffer->count.storeRelease(count + 1);
+}
+
+bool Trace::exportChromeJson(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    QTextStream out(&file);
+    out << "{\"traceEvents\":[\n";
+    auto& shared = registry();
+    QMutexLocker locker(&shared.mutex);
+    bool first = true;
+    for (auto buffer : shared.buffers) {
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << buffer->threadId << ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+        first = false;
+        auto count = buffer->count.loadAcquire();
+        auto oldest = count > EVENTS_PER_THREAD ? count - EVENTS_PER_THREAD : 0;
+        for (auto i = oldest; i < count; ++i) {
+            const auto& event = buffer->events[i % EVENTS_PER_THREAD];
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << buffer->threadId << ",\"ts\":" << microseconds(event.begin)
+                << ",\"dur\":" << microseconds(event.end - event.begin) << "}";
+        }
+    }
+    out << "\n]}\n";
+    out.flush();
+    return file.error() == QFile::NoError;
+}
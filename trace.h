@@ -0,0 +1,103 @@
+/*
+ * Copyright 2018 Max Harmathy
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QString>
+#include <QtGlobal>
+
+/**
+ * @brief The Trace class records the duration of rendering stages for a timeline.
+ *
+ * Tracing is switched on by setting the environment variable HARFBUZZ_QML_TRACE to the path of
+ * the trace file, which is written in the Chrome trace event format when the process exits. It
+ * can be opened with chrome://tracing or Perfetto.
+ *
+ * Events are recorded into a ring buffer per thread, which keeps the most recent events, so
+ * recording takes no lock. When tracing is off, a scope costs one check of a flag.
+ */
+class Trace
+{
+private:
+    static const bool enabled;
+
+public:
+    static bool isEnabled()
+    {
+        return enabled;
+    }
+
+    /**
+     * @return nanoseconds since the start of tracing
+     */
+    static qint64 now();
+
+    /**
+     * @brief record an event of the calling thread.
+     * @param name of the event, which has to be a string literal
+     * @param begin see @ref now
+     * @param end see @ref now
+     */
+    static void record(const char* name, qint64 begin, qint64 end);
+
+    /**
+     * @brief exportChromeJson writes the recorded events in the Chrome trace event format.
+     *
+     * Threads may record while the events are exported, but events being recorded concurrently
+     * might be garbled. Hence the export should happen, when no rendering is in progress.
+     * @param path of the trace file
+     * @return false, if the file could not be written
+     */
+    static bool exportChromeJson(const QString& path);
+};
+
+/**
+ * @brief The TraceScope class records an event for the life time of the scope.
+ */
+class TraceScope
+{
+private:
+    const char* name;
+    const qint64 begin;
+
+public:
+    explicit TraceScope(const char* name)
+        : name(name), begin(Trace::isEnabled() ? Trace::now() : -1)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (begin >= 0) {
+            Trace::record(name, begin, Trace::now());
+        }
+    }
+
+    TraceScope& operator=(const TraceScope&) = delete;
+    TraceScope(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCATENATE_(a, b) a##b
+#define TRACE_CONCATENATE(a, b) TRACE_CONCATENATE_(a, b)
+
+/**
+ * Trace the rest of the enclosing scope as an event with the given name, a string literal.
+ */
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCATENATE(traceScope, __LINE__)(name)
+
+#endif // TRACE_H